@@ -0,0 +1,571 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "driver.hpp"
+#include "system.hpp"
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct Options {
+    unsigned int machines = 4;
+    unsigned int workers = 8;
+    unsigned int max_workers = 0;
+    double grow_after_us = 1000;
+    double idle_after_ms = 1000;
+    unsigned int timeout_ms = 1000;
+    double duration_s = 5;
+    double rate = 2000;
+    unsigned int clients = 4;
+    unsigned int collectors = 32;
+    unsigned int min_items = 3;
+    unsigned int max_items = 6;
+    double collect_delay_us = 0;
+    std::string latency = "exp";
+    double latency_us = 50;
+    unsigned int slow_machines = 0;
+    double slow_factor = 10;
+    unsigned int dispatch_fairness = 4;
+    std::array<double, 3> priority_mix{0, 1, 0};
+    std::array<double, 3> deadlines_us{0, 0, 0};
+    size_t max_pending = 0;
+    bool admission_estimate = false;
+    double probe_ms = 0;
+    size_t prefetch_limit = 0;
+    double prefetch_window_ms = 100;
+    double cancel_rate = 0;
+    unsigned int stock = 0;
+    bool pooled_products = false;
+    unsigned int batch = 1;
+    double failure_rate = 0;
+    double abandon_rate = 0;
+    double report_interval_s = 0;
+    unsigned int seed = 1;
+    std::vector<unsigned int> scaling;
+    std::string trace;
+
+    void set(const std::string &key, const std::string &value) {
+        if (key == "machines") machines = std::stoul(value);
+        else if (key == "workers") workers = std::stoul(value);
+        else if (key == "max-workers") max_workers = std::stoul(value);
+        else if (key == "grow-after-us") grow_after_us = std::stod(value);
+        else if (key == "idle-after-ms") idle_after_ms = std::stod(value);
+        else if (key == "timeout-ms") timeout_ms = std::stoul(value);
+        else if (key == "duration") duration_s = std::stod(value);
+        else if (key == "rate") rate = std::stod(value);
+        else if (key == "clients") clients = std::stoul(value);
+        else if (key == "collectors") collectors = std::stoul(value);
+        else if (key == "min-items") min_items = std::stoul(value);
+        else if (key == "max-items") max_items = std::stoul(value);
+        else if (key == "collect-delay-us") collect_delay_us = std::stod(value);
+        else if (key == "latency") latency = value;
+        else if (key == "latency-us") latency_us = std::stod(value);
+        else if (key == "slow-machines") slow_machines = std::stoul(value);
+        else if (key == "slow-factor") slow_factor = std::stod(value);
+        else if (key == "dispatch-fairness") dispatch_fairness = std::stoul(value);
+        else if (key == "priority-mix") priority_mix = triple(value);
+        else if (key == "deadlines-us") deadlines_us = triple(value);
+        else if (key == "max-pending") max_pending = std::stoul(value);
+        else if (key == "trace") trace = value;
+        else if (key == "admission-estimate") admission_estimate = std::stoul(value) != 0;
+        else if (key == "probe-ms") probe_ms = std::stod(value);
+        else if (key == "prefetch-limit") prefetch_limit = std::stoul(value);
+        else if (key == "prefetch-window-ms") prefetch_window_ms = std::stod(value);
+        else if (key == "cancel-rate") cancel_rate = std::stod(value);
+        else if (key == "stock") stock = std::stoul(value);
+        else if (key == "pooled-products") pooled_products = std::stoul(value) != 0;
+        else if (key == "batch") batch = std::stoul(value);
+        else if (key == "failure-rate") failure_rate = std::stod(value);
+        else if (key == "abandon-rate") abandon_rate = std::stod(value);
+        else if (key == "report-interval") report_interval_s = std::stod(value);
+        else if (key == "seed") seed = std::stoul(value);
+        else if (key == "scaling") scaling = list(value);
+        else throw std::invalid_argument("unknown option --" + key);
+    }
+
+    // Per-class values for HIGH, NORMAL and LOW, e.g. "0.1,0.6,0.3".
+    static std::array<double, 3> triple(const std::string &value) {
+        std::array<double, 3> result{};
+        std::istringstream in(value);
+        std::string item;
+        for (auto &field: result) {
+            if (!std::getline(in, item, ','))
+                throw std::invalid_argument("expected three comma separated values");
+            field = std::stod(item);
+        }
+        return result;
+    }
+
+    // Comma separated worker counts, e.g. "1,2,4,8".
+    static std::vector<unsigned int> list(const std::string &value) {
+        std::vector<unsigned int> result;
+        std::istringstream in(value);
+        std::string item;
+        while (std::getline(in, item, ',')) {
+            result.push_back(std::stoul(item));
+        }
+        return result;
+    }
+
+    static std::string tripleJson(const std::array<double, 3> &values) {
+        std::ostringstream out;
+        out << "[" << values[0] << ", " << values[1] << ", " << values[2] << "]";
+        return out.str();
+    }
+
+    std::string json() const {
+        std::ostringstream out;
+        out << "{\"machines\": " << machines
+            << ", \"workers\": " << workers
+            << ", \"max_workers\": " << max_workers
+            << ", \"grow_after_us\": " << grow_after_us
+            << ", \"idle_after_ms\": " << idle_after_ms
+            << ", \"timeout_ms\": " << timeout_ms
+            << ", \"duration_s\": " << duration_s
+            << ", \"rate\": " << rate
+            << ", \"clients\": " << clients
+            << ", \"collectors\": " << collectors
+            << ", \"min_items\": " << min_items
+            << ", \"max_items\": " << max_items
+            << ", \"collect_delay_us\": " << collect_delay_us
+            << ", \"latency\": \"" << latency << "\""
+            << ", \"latency_us\": " << latency_us
+            << ", \"slow_machines\": " << slow_machines
+            << ", \"slow_factor\": " << slow_factor
+            << ", \"dispatch_fairness\": " << dispatch_fairness
+            << ", \"priority_mix\": " << tripleJson(priority_mix)
+            << ", \"deadlines_us\": " << tripleJson(deadlines_us)
+            << ", \"max_pending\": " << max_pending
+            << ", \"admission_estimate\": " << (admission_estimate ? "true" : "false")
+            << ", \"probe_ms\": " << probe_ms
+            << ", \"prefetch_limit\": " << prefetch_limit
+            << ", \"prefetch_window_ms\": " << prefetch_window_ms
+            << ", \"cancel_rate\": " << cancel_rate
+            << ", \"stock\": " << stock
+            << ", \"pooled_products\": " << (pooled_products ? "true" : "false")
+            << ", \"batch\": " << batch
+            << ", \"failure_rate\": " << failure_rate
+            << ", \"abandon_rate\": " << abandon_rate
+            << ", \"report_interval_s\": " << report_interval_s
+            << ", \"seed\": " << seed
+            << ", \"hardware_threads\": " << std::thread::hardware_concurrency()
+            << "}";
+        return out.str();
+    }
+};
+
+class SyntheticProduct : public Product {
+};
+
+class PooledSyntheticProduct : public Product, public Pooled<PooledSyntheticProduct> {
+};
+
+// Produces `batch` items per production run, each run taking a latency drawn
+// from the configured distribution (scaled for slow machines), and fails each request with
+// `failure_rate` probability.
+class SyntheticMachine : public Machine {
+    const Options &options;
+    double scale;
+    std::mutex mutex;
+    std::mt19937_64 random;
+    unsigned int stock{0};
+
+    bench_clock::duration sampleLatency() {
+        double mean = options.latency_us * scale;
+        double value = mean;
+        if (options.latency == "exp") {
+            value = std::exponential_distribution<double>(1 / mean)(random);
+        } else if (options.latency == "lognormal") {
+            double sigma = 1;
+            double mu = std::log(mean) - sigma * sigma / 2;
+            value = std::lognormal_distribution<double>(mu, sigma)(random);
+        } else if (options.latency == "uniform") {
+            value = std::uniform_real_distribution<double>(0, 2 * mean)(random);
+        }
+        return std::chrono::duration_cast<bench_clock::duration>(
+                std::chrono::duration<double, std::micro>(value));
+    }
+
+    std::unique_ptr<Product> make() const {
+        if (options.pooled_products) return std::unique_ptr<Product>(new PooledSyntheticProduct());
+        return std::make_unique<SyntheticProduct>();
+    }
+
+    bool fails() {
+        return options.failure_rate > 0 &&
+               std::bernoulli_distribution(options.failure_rate)(random);
+    }
+
+public:
+    SyntheticMachine(const Options &options, unsigned int seed, double scale) :
+            options(options), scale(scale), random(seed) {}
+
+    std::unique_ptr<Product> getProduct() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (fails()) throw MachineFailure();
+        if (stock > 0) {
+            stock--;
+            return make();
+        }
+
+        auto latency = sampleLatency();
+        lock.unlock();
+        std::this_thread::sleep_for(latency);
+        lock.lock();
+        stock += std::max(options.batch, 1u) - 1;
+        return make();
+    }
+
+    std::vector<std::unique_ptr<Product>> getProducts(size_t n) override {
+        std::vector<std::unique_ptr<Product>> products;
+        std::unique_lock<std::mutex> lock(mutex);
+        if (fails()) throw MachineFailure();
+        for (; stock > 0 && products.size() < n; stock--) {
+            products.push_back(make());
+        }
+        lock.unlock();
+
+        if (products.empty()) products.push_back(getProduct());
+        return products;
+    }
+
+    void returnProduct(std::unique_ptr<Product>) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        stock++;
+    }
+
+    void start() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        stock = options.stock;
+    }
+
+    void stop() override {}
+};
+
+const char *healthName(MachineHealth health) {
+    switch (health) {
+        case MachineHealth::CLOSED:
+            return "closed";
+        case MachineHealth::OPEN:
+            return "open";
+        default:
+            return "half_open";
+    }
+}
+
+std::string statsJson(const SystemStats &stats) {
+    std::ostringstream out;
+    out << "{\"machines\": [";
+    for (size_t i = 0; i < stats.machines.size(); i++) {
+        auto &machine = stats.machines[i];
+        out << (i ? ", " : "")
+            << "{\"product\": \"" << machine.product << "\""
+            << ", \"on_menu\": " << (machine.on_menu ? "true" : "false")
+            << ", \"health\": \"" << healthName(machine.health) << "\""
+            << ", \"queue_depth\": " << machine.queue_depth
+            << ", \"fetched\": " << machine.fetched
+            << ", \"failed\": " << machine.failed
+            << ", \"fast_failed\": " << machine.fast_failed
+            << ", \"probes\": " << machine.probes
+            << ", \"returned\": " << machine.returned
+            << ", \"prefetched\": " << machine.prefetched
+            << ", \"served_from_stock\": " << machine.served_from_stock
+            << ", \"stock\": " << machine.stock
+            << ", \"fetch_latency_us\": " << histogramJson(machine.fetch_latency) << "}";
+    }
+    out << "], \"workers\": [";
+    for (size_t i = 0; i < stats.workers.size(); i++) {
+        auto &worker = stats.workers[i];
+        auto total = (worker.busy + worker.idle).count();
+        out << (i ? ", " : "")
+            << "{\"active\": " << (worker.active ? "true" : "false")
+            << ", \"orders\": " << worker.orders
+            << ", \"utilization\": " << (total ? (double) worker.busy.count() / total : 0) << "}";
+    }
+    out << "], \"priorities\": [";
+    for (size_t i = 0; i < stats.priorities.size(); i++) {
+        auto &priority = stats.priorities[i];
+        out << (i ? ", " : "")
+            << "{\"orders\": " << priority.orders
+            << ", \"with_deadline\": " << priority.with_deadline
+            << ", \"missed\": " << priority.missed
+            << ", \"miss_rate\": " << (priority.with_deadline
+                                        ? (double) priority.missed / priority.with_deadline : 0)
+            << ", \"latency_us\": " << histogramJson(priority.latency) << "}";
+    }
+    out << "], \"active_workers\": " << stats.active_workers
+        << ", \"registered_orders\": " << stats.registered_orders
+        << ", \"queued_us\": " << histogramJson(stats.queued)
+        << ", \"preparing_us\": " << histogramJson(stats.preparing)
+        << ", \"collected_after_us\": " << histogramJson(stats.collected)
+        << ", \"expired_after_us\": " << histogramJson(stats.expired) << "}";
+    return out.str();
+}
+
+// `submitted` is when the order was scheduled to go out, not when tryOrder
+// returned, so that a client held up by a slow submit does not hide the
+// delay from the latencies. `budget` is the order's deadline, or the client
+// timeout if it has none; orders collected within it count towards goodput.
+struct InFlight {
+    std::unique_ptr<CoasterPager> pager;
+    bench_clock::time_point submitted;
+    bench_clock::duration budget;
+};
+
+// Resident set size in KiB, 0 where /proc is not available.
+unsigned long residentKiB() {
+    std::ifstream statm("/proc/self/statm");
+    unsigned long size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Latencies go to fixed-size histograms so that long soak runs stay flat.
+struct Results {
+    LatencyHistogram order_to_ready;
+    LatencyHistogram ready_to_collect;
+    std::atomic<unsigned long> submitted{0};
+    std::atomic<unsigned long> rejected{0};
+    std::atomic<unsigned long> overloaded{0};
+    std::atomic<unsigned long> on_time{0};
+    std::atomic<unsigned long> collected{0};
+    std::atomic<unsigned long> failed{0};
+    std::atomic<unsigned long> expired{0};
+    std::atomic<unsigned long> abandoned{0};
+    std::atomic<unsigned long> cancelled{0};
+    unsigned long report_records{0};
+};
+
+// Pagers are handed to collectors round-robin, and a collector waits on them
+// in submission order (see Collector in driver.hpp).
+void finishOrder(System &system, const Options &options, Results &results,
+                 std::mt19937_64 &random, InFlight &order) {
+    if (options.cancel_rate > 0 &&
+        std::bernoulli_distribution(options.cancel_rate)(random)) {
+        system.cancelOrder(std::move(order.pager));
+        results.cancelled++;
+        return;
+    }
+
+    try {
+        order.pager->wait();
+    }
+    catch (FulfillmentFailure &) {
+        results.failed++;
+        return;
+    }
+    auto ready = bench_clock::now();
+    results.order_to_ready.record(ready - order.submitted);
+
+    if (options.abandon_rate > 0 &&
+        std::bernoulli_distribution(options.abandon_rate)(random)) {
+        results.abandoned++;
+        return;
+    }
+
+    if (options.collect_delay_us > 0)
+        std::this_thread::sleep_until(
+                ready + std::chrono::duration_cast<bench_clock::duration>(
+                        std::chrono::duration<double, std::micro>(options.collect_delay_us)));
+
+    try {
+        system.collectOrder(std::move(order.pager));
+        results.ready_to_collect.record(bench_clock::now() - ready);
+        results.collected++;
+        if (ready - order.submitted <= order.budget) results.on_time++;
+    }
+    catch (OrderExpiredException &) {
+        results.expired++;
+    }
+    catch (FulfillmentFailure &) {
+        results.failed++;
+    }
+}
+
+void runBenchmark(const Options &options) {
+    System::machines_t machines;
+    std::vector<std::string> names;
+    for (unsigned int i = 0; i < options.machines; i++) {
+        names.push_back("product" + std::to_string(i));
+        machines.emplace(names.back(),
+                         std::make_shared<SyntheticMachine>(
+                                 options, options.seed + i,
+                                 i < options.slow_machines ? options.slow_factor : 1));
+    }
+
+    System system{machines, options.workers, options.timeout_ms,
+                  options.dispatch_fairness, options.max_workers};
+    system.setScaling(std::chrono::duration_cast<bench_clock::duration>(
+                              std::chrono::duration<double, std::micro>(options.grow_after_us)),
+                      std::chrono::duration_cast<bench_clock::duration>(
+                              std::chrono::duration<double, std::milli>(options.idle_after_ms)));
+    system.setAdmission(options.max_pending, options.admission_estimate);
+    system.setProbeInterval(std::chrono::duration_cast<bench_clock::duration>(
+            std::chrono::duration<double, std::milli>(options.probe_ms)));
+    system.setPrefetch(options.prefetch_limit, std::chrono::duration_cast<bench_clock::duration>(
+            std::chrono::duration<double, std::milli>(options.prefetch_window_ms)));
+    if (!options.trace.empty()) system.startTrace(options.trace);
+    Results results;
+
+    std::vector<std::unique_ptr<Collector<InFlight>>> collectors;
+    for (unsigned int i = 0; i < std::max(options.collectors, 1u); i++) {
+        std::mt19937_64 random(options.seed * 104729 + i);
+        collectors.push_back(std::make_unique<Collector<InFlight>>(
+                [&system, &options, &results, random](InFlight &order) mutable {
+                    finishOrder(system, options, results, random, order);
+                }));
+    }
+
+    std::atomic<unsigned long> next_collector{0};
+    auto start = bench_clock::now();
+    auto end = start + std::chrono::duration_cast<bench_clock::duration>(
+            std::chrono::duration<double>(options.duration_s));
+
+    std::vector<std::thread> clients;
+    for (unsigned int c = 0; c < std::max(options.clients, 1u); c++) {
+        clients.emplace_back([&, c] {
+            std::mt19937_64 random(options.seed * 7919 + c);
+            std::exponential_distribution<double> gap(
+                    options.rate / std::max(options.clients, 1u));
+            std::uniform_int_distribution<unsigned int> size(
+                    options.min_items, std::max(options.min_items, options.max_items));
+            std::uniform_int_distribution<size_t> item(0, names.size() - 1);
+            std::discrete_distribution<unsigned int> priority(
+                    options.priority_mix.begin(), options.priority_mix.end());
+
+            auto next = start;
+            while (true) {
+                next += std::chrono::duration_cast<bench_clock::duration>(
+                        std::chrono::duration<double>(gap(random)));
+                if (next >= end) break;
+                std::this_thread::sleep_until(next);
+
+                std::vector<ProductId> products;
+                for (unsigned int i = size(random); i > 0; i--) {
+                    products.push_back(system.getProductId(names[item(random)]));
+                }
+
+                auto cls = priority(random);
+                auto deadline = std::chrono::duration_cast<bench_clock::duration>(
+                        std::chrono::duration<double, std::micro>(options.deadlines_us[cls]));
+
+                auto budget = deadline > bench_clock::duration::zero()
+                              ? deadline : std::chrono::milliseconds(options.timeout_ms);
+
+                try {
+                    InFlight order{system.tryOrder(std::move(products), Priority(cls), deadline),
+                                   next, budget};
+                    if (order.pager == nullptr) {
+                        results.overloaded++;
+                        continue;
+                    }
+                    results.submitted++;
+                    collectors[next_collector++ % collectors.size()]->add(std::move(order));
+                }
+                catch (BadOrderException &) {
+                    results.rejected++;
+                }
+            }
+        });
+    }
+
+    std::mutex reporter_mutex;
+    std::condition_variable reporter_cv;
+    bool finished = false;
+    std::thread reporter;
+    if (options.report_interval_s > 0) {
+        reporter = std::thread([&] {
+            auto interval = std::chrono::duration_cast<bench_clock::duration>(
+                    std::chrono::duration<double>(options.report_interval_s));
+            std::unique_lock<std::mutex> lock(reporter_mutex);
+            for (auto next = start + interval;
+                 !reporter_cv.wait_until(lock, next, [&] { return finished; });
+                 next += interval) {
+                results.report_records += system.drainReports().records.size();
+                auto stats = system.stats();
+                std::cerr << "{\"t_s\": " << std::chrono::duration<double>(
+                                bench_clock::now() - start).count()
+                          << ", \"rss_kib\": " << residentKiB()
+                          << ", \"registered_orders\": " << stats.registered_orders
+                          << ", \"pending_orders\": " << stats.pending_orders
+                          << ", \"active_workers\": " << stats.active_workers
+                          << ", \"collected\": " << results.collected
+                          << ", \"expired\": " << results.expired
+                          << ", \"abandoned\": " << results.abandoned
+                          << ", \"cancelled\": " << results.cancelled
+                          << ", \"report_records\": " << results.report_records
+                          << ", \"failed\": " << results.failed << "}" << std::endl;
+            }
+        });
+    }
+
+    for (auto &client: clients) {
+        client.join();
+    }
+    for (auto &collector: collectors) {
+        collector->finish();
+    }
+    if (reporter.joinable()) {
+        std::unique_lock<std::mutex> lock(reporter_mutex);
+        finished = true;
+        reporter_cv.notify_one();
+        lock.unlock();
+        reporter.join();
+    }
+    auto elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    auto stats = system.stats();
+    results.report_records += system.drainReports().records.size();
+    system.shutdown();
+
+    std::cout << "{\"config\": " << options.json()
+              << ", \"elapsed_s\": " << elapsed
+              << ", \"submitted\": " << results.submitted
+              << ", \"rejected\": " << results.rejected
+              << ", \"overloaded\": " << results.overloaded
+              << ", \"collected\": " << results.collected
+              << ", \"failed\": " << results.failed
+              << ", \"expired\": " << results.expired
+              << ", \"abandoned\": " << results.abandoned
+              << ", \"cancelled\": " << results.cancelled
+              << ", \"report_records\": " << results.report_records
+              << ", \"orders_per_s\": " << results.collected / elapsed
+              << ", \"goodput_per_s\": " << results.on_time / elapsed
+              << ", \"order_to_ready_us\": " << histogramJson(results.order_to_ready)
+              << ", \"ready_to_collect_us\": " << histogramJson(results.ready_to_collect)
+              << ", \"system\": " << statsJson(stats)
+              << "}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) return 1;
+    if (options.machines == 0) {
+        std::cerr << "--machines must be positive" << std::endl;
+        return 1;
+    }
+
+    if (options.scaling.empty()) {
+        runBenchmark(options);
+        return 0;
+    }
+
+    // One result line per worker count.
+    for (auto workers: options.scaling) {
+        auto point = options;
+        point.workers = workers;
+        runBenchmark(point);
+    }
+}
@@ -1,10 +1,15 @@
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <coroutine>
 #include <deque>
+#include <future>
+#include <stdexcept>
 #include <thread>
 #include <iostream>
 #include <typeinfo>
 
+#include "static_system.hpp"
 #include "system.hpp"
 
 template <typename T, typename V>
@@ -24,6 +29,14 @@ class Chips : public Product
 {
 };
 
+class Coffee : public Product
+{
+public:
+    explicit Coffee(unsigned int serial) : serial(serial) {}
+
+    unsigned int serial;
+};
+
 class BurgerMachine : public Machine
 {
     std::atomic_uint burgersMade;
@@ -43,6 +56,22 @@ public:
         }
     }
 
+    std::vector<std::unique_ptr<Product>> getProducts(size_t n)
+    {
+        std::vector<std::unique_ptr<Product>> products;
+        unsigned int stock = burgersMade;
+        while (stock > 0 && products.size() < n)
+        {
+            if (burgersMade.compare_exchange_weak(stock, stock - 1))
+            {
+                products.push_back(std::unique_ptr<Product>(new Burger()));
+                stock--;
+            }
+        }
+        if (products.empty()) products.push_back(getProduct());
+        return products;
+    }
+
     void returnProduct(std::unique_ptr<Product> product)
     {
         if (!checkType<Burger>(product.get())) throw BadProductException();
@@ -98,6 +127,21 @@ public:
         return product;
     }
 
+    std::vector<std::unique_ptr<Product>> getProducts(size_t n)
+    {
+        if (!running) throw MachineNotWorking();
+        std::vector<std::unique_ptr<Product>> products;
+        wcount++;
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this](){ return !queue.empty(); });
+        wcount--;
+        while (!queue.empty() && products.size() < n) {
+            products.push_back(std::move(queue.front()));
+            queue.pop_front();
+        }
+        return products;
+    }
+
     void returnProduct(std::unique_ptr<Product> product)
     {
         if (!checkType<Chips>(product.get())) throw BadProductException();
@@ -133,6 +177,48 @@ public:
     }
 };
 
+// Brews one coffee at a time, numbering them.
+class CoffeeMachine : public Machine
+{
+    std::atomic_uint brewed{0};
+public:
+    std::unique_ptr<Product> getProduct()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        return std::unique_ptr<Product>(new Coffee(brewed++));
+    }
+
+    void returnProduct(std::unique_ptr<Product> product)
+    {
+        if (!checkType<Coffee>(product.get())) throw BadProductException();
+    }
+
+    void start() {}
+
+    void stop() {}
+};
+
+// Starts right away and frees itself when done; results go out through the
+// promise the coroutine owns.
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+DetachedTask collectInCoroutine(System &system, std::unique_ptr<CoasterPager> pager,
+                                std::promise<std::vector<std::unique_ptr<Product>>> result) {
+    try {
+        result.set_value(co_await system.collectAsync(std::move(pager)));
+    }
+    catch (...) {
+        result.set_exception(std::current_exception());
+    }
+}
 
 int main() {
     System system{
@@ -144,6 +230,16 @@ int main() {
         10,
         1
     };
+    // For checks that collect some time after the order is ready, which a
+    // 1 ms client timeout would turn into expirations.
+    System patient{
+        {
+            {"burger", std::shared_ptr<Machine>(new BurgerMachine())},
+            {"chips", std::shared_ptr<Machine>(new ChipsMachine())},
+        },
+        4,
+        1000
+    };
 
     auto client1 = std::thread([&system]() {
         auto menu = system.getMenu();
@@ -199,6 +295,45 @@ int main() {
         }
     });
 
+    auto client7 = std::thread([&system]() {
+        auto products = system.collectFuture(system.order({"chips", "burger"}));
+        if (products.get().size() == 2) std::cout << "OK 7\n";
+    });
+
+    auto coroutine_client = std::thread([&patient]() {
+        patient.collectWhenReady(patient.order({"burger"}),
+                                 [](std::vector<std::unique_ptr<Product>>, std::exception_ptr) {
+                                     throw std::runtime_error("callback failed");
+                                 });
+
+        std::promise<std::vector<std::unique_ptr<Product>>> later, now;
+        auto later_products = later.get_future(), now_products = now.get_future();
+        collectInCoroutine(patient, patient.order({"burger", "chips"}), std::move(later));
+        auto pager = patient.order({"burger"});
+        pager->wait();
+        collectInCoroutine(patient, std::move(pager), std::move(now));
+
+        try {
+            auto first = later_products.get(), second = now_products.get();
+            unsigned int burgers = 0, chips = 0;
+            for (auto &product: first) {
+                burgers += checkType<Burger>(product.get());
+                chips += checkType<Chips>(product.get());
+            }
+            if (burgers == 1 && chips == 1 && second.size() == 1 &&
+                checkType<Burger>(second[0].get()))
+                std::cout << "OK 10\n";
+        }
+        catch (std::exception &) {}
+    });
+
+    auto batch_client = std::thread([&patient]() {
+        auto pagers = patient.orderBatch({{"burger"}, {"chips"}, {"burger", "chips"}});
+        for (auto &pager: pagers) pager->wait();
+        auto orders = patient.collectOrders(pagers);
+        if (orders.size() == 3 && orders[2].size() == 2) std::cout << "OK 8\n";
+    });
+
     auto extreme_client = std::thread([&system]() {
         unsigned int size = 20;
         std::vector<std::unique_ptr<CoasterPager>> pagers;
@@ -222,9 +357,13 @@ int main() {
     client4.join();
     client5.join();
     client6.join();
+    client7.join();
+    coroutine_client.join();
+    batch_client.join();
     extreme_client.join();
 
     auto reports = system.shutdown();
+    patient.shutdown();
 
     auto client3 = std::thread([&system](){
         system.getMenu();
@@ -239,6 +378,56 @@ int main() {
     });
     client3.join();
 
+    StaticSystem<MenuItem<"burger", BurgerMachine>, MenuItem<"chips", ChipsMachine>> fixed{2, 1};
+    auto pager = fixed.order<"burger", "chips">();
+    pager->wait();
+    auto products = fixed.collectOrder(std::move(pager));
+    if (products.size() == 2 && fixed.getPendingOrders().empty()) std::cout << "OK 9\n";
+    fixed.shutdown();
+
+    System cancelling{
+        {
+            {"burger", std::shared_ptr<Machine>(new BurgerMachine())},
+            {"chips", std::shared_ptr<Machine>(new ChipsMachine())},
+        },
+        2,
+        1000
+    };
+    auto burgersReturned = [&cancelling]() {
+        for (auto &machine: cancelling.stats().machines) {
+            if (machine.product == "burger") return machine.returned;
+        }
+        return uint64_t{0};
+    };
+    // The burger comes from stock at once, the chips take a second.
+    auto cancelled = cancelling.order({"burger", "chips"});
+    auto cancelled_id = cancelled->getId();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    cancelling.cancelOrder(std::move(cancelled));
+    auto pending = cancelling.getPendingOrders();
+    auto other = cancelling.order({"burger"});
+    other->wait();
+    if (std::find(pending.begin(), pending.end(), cancelled_id) == pending.end() &&
+        cancelling.collectOrder(std::move(other)).size() == 1 && burgersReturned() == 1)
+        std::cout << "OK 11\n";
+    cancelling.shutdown();
+
+    // One machine serves orders in the order they were submitted, however
+    // the workers pick them up.
+    System serving{{{"coffee", std::shared_ptr<Machine>(new CoffeeMachine())}}, 8, 1000};
+    std::vector<std::unique_ptr<CoasterPager>> coffees;
+    for (unsigned int k = 0; k < 16; k++) {
+        coffees.push_back(serving.order({"coffee"}));
+    }
+    std::vector<unsigned int> serials;
+    for (auto &coffee: coffees) {
+        coffee->wait();
+        auto products = serving.collectOrder(std::move(coffee));
+        serials.push_back(dynamic_cast<Coffee &>(*products[0]).serial);
+    }
+    if (std::is_sorted(serials.begin(), serials.end())) std::cout << "OK 12\n";
+    serving.shutdown();
+
     unsigned int i = 0;
     for (auto &report: reports) {
         unsigned int j = 0;
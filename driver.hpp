@@ -0,0 +1,103 @@
+#ifndef DRIVER_HPP
+#define DRIVER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "stats.hpp"
+
+// Pieces shared by the programs that drive a System with load (bench,
+// replay).
+
+// Hands `options.set(key, value)` every --key=value argument. Prints the
+// error and returns false if one is malformed or rejected.
+template<typename Options>
+bool parseOptions(int argc, char **argv, Options &options) {
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+            if (arg.rfind("--", 0) != 0 || eq == std::string::npos)
+                throw std::invalid_argument("expected --key=value, got " + arg);
+            options.set(arg.substr(2, eq - 2), arg.substr(eq + 1));
+        }
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Values in microseconds.
+inline std::string histogramJson(const HistogramSnapshot &histogram) {
+    std::ostringstream out;
+    out << "{\"count\": " << histogram.count
+        << ", \"mean\": " << histogram.mean() / 1000.0
+        << ", \"p50\": " << histogram.percentile(0.5) / 1000.0
+        << ", \"p99\": " << histogram.percentile(0.99) / 1000.0
+        << ", \"p999\": " << histogram.percentile(0.999) / 1000.0
+        << ", \"max\": " << histogram.max / 1000.0 << "}";
+    return out.str();
+}
+
+inline std::string histogramJson(const LatencyHistogram &histogram) {
+    HistogramSnapshot snapshot;
+    snapshot.add(histogram);
+    return histogramJson(snapshot);
+}
+
+// Runs `handle` on the orders added to it, one at a time on its own thread
+// and in the order they were added. An order that takes long to finish, e.g.
+// one waited on while later ones are already done, holds up those behind it;
+// drivers spread their orders over many collectors to keep that skew small.
+template<typename Order>
+class Collector {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Order> queue;
+    bool done{false};
+    std::thread thread;
+
+public:
+    template<typename Handle>
+    explicit Collector(Handle handle) {
+        thread = std::thread([this, handle]() mutable {
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return done || !queue.empty(); });
+                if (queue.empty()) break;
+                auto order = std::move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+
+                handle(order);
+            }
+        });
+    }
+
+    void add(Order order) {
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.push_back(std::move(order));
+        cv.notify_one();
+    }
+
+    // Returns once every order added has been handled.
+    void finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_one();
+        lock.unlock();
+        thread.join();
+    }
+};
+
+#endif // DRIVER_HPP
@@ -4,6 +4,7 @@
 #include <exception>
 #include <memory>
 #include <thread>
+#include <vector>
 
 class MachineFailure : public std::exception
 {
@@ -32,6 +33,24 @@ public:
     virtual ~Machine() = default;
     virtual std::unique_ptr<Product> getProduct() = 0;
     virtual void returnProduct(std::unique_ptr<Product> product) = 0;
+
+    // May hand out fewer than n products (but at least one); the caller asks
+    // again for the rest. Machines that can hand over stock in bulk should
+    // override it, the default produces a single item.
+    virtual std::vector<std::unique_ptr<Product>> getProducts(size_t n)
+    {
+        std::vector<std::unique_ptr<Product>> products;
+        if (n > 0) products.push_back(getProduct());
+        return products;
+    }
+
+    virtual void returnProducts(std::vector<std::unique_ptr<Product>> products)
+    {
+        for (auto &product: products) {
+            returnProduct(std::move(product));
+        }
+    }
+
     virtual void start() = 0;
     virtual void stop() = 0;
 };
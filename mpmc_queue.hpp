@@ -0,0 +1,185 @@
+#ifndef MPMC_QUEUE_HPP
+#define MPMC_QUEUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Lets threads sleep until something changes: read `epoch`, re-check the
+// condition, then wait(epoch). Notifying skips the wake-up syscall while
+// nobody sleeps, and notify(count) wakes no more sleepers than there are
+// new elements to take.
+struct EventCount {
+    std::atomic<uint32_t> epoch{0};
+    std::atomic<uint32_t> sleepers{0};
+
+    void wait(uint32_t seen) {
+        sleepers.fetch_add(1);
+        epoch.wait(seen);
+        sleepers.fetch_sub(1);
+    }
+
+    void notifyOne() {
+        notify(1);
+    }
+
+    void notify(size_t count) {
+        epoch.fetch_add(1);
+        auto sleeping = sleepers.load();
+        if (sleeping == 0) return;
+        if (count >= sleeping) {
+            epoch.notify_all();
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            epoch.notify_one();
+        }
+    }
+
+    void notifyAll() {
+        epoch.fetch_add(1);
+        epoch.notify_all();
+    }
+};
+
+// Bounded multi-producer multi-consumer ring (D. Vyukov). Consumers poll with
+// tryPop and bring their own wake-ups; a blocking push parks until a pop
+// makes room.
+template<typename T>
+class MPMCQueue {
+public:
+    explicit MPMCQueue(size_t capacity) : cells(new Cell[capacity]),
+                                          mask(capacity - 1) {
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MPMCQueue(const MPMCQueue &) = delete;
+
+    MPMCQueue &operator=(const MPMCQueue &) = delete;
+
+    bool tryPush(T &value) {
+        Cell *cell;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            auto dif = (intptr_t) seq - (intptr_t) pos;
+            if (dif == 0) {
+                if (enqueue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Claims `count` consecutive positions at once, so the elements stay
+    // together in submission order. Fails without side effects if they do not
+    // fit.
+    bool tryPush(T *values, size_t count) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            bool stale = false, fits = true;
+            for (size_t i = 0; i < count && fits && !stale; i++) {
+                size_t seq = cells[(pos + i) & mask].sequence.load(
+                        std::memory_order_acquire);
+                auto dif = (intptr_t) seq - (intptr_t) (pos + i);
+                if (dif < 0) fits = false;
+                else if (dif > 0) stale = true;
+            }
+
+            if (stale) {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            } else if (!fits) {
+                return false;
+            } else if (enqueue_pos.compare_exchange_weak(
+                    pos, pos + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            auto &cell = cells[(pos + i) & mask];
+            cell.value = std::move(values[i]);
+            cell.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return true;
+    }
+
+    bool tryPop(T &value) {
+        Cell *cell;
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            auto dif = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (dif == 0) {
+                if (dequeue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        value = std::move(cell->value);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        not_full.notifyOne();
+        return true;
+    }
+
+    void push(T value) {
+        while (true) {
+            auto epoch = not_full.epoch.load();
+            if (tryPush(value)) return;
+            not_full.wait(epoch);
+        }
+    }
+
+    // Batches larger than the ring are published in ring-sized chunks.
+    void push(T *values, size_t count) {
+        while (count > 0) {
+            auto chunk = std::min(count, mask + 1);
+            auto epoch = not_full.epoch.load();
+            if (tryPush(values, chunk)) {
+                values += chunk;
+                count -= chunk;
+            } else {
+                not_full.wait(epoch);
+            }
+        }
+    }
+
+    [[nodiscard]] size_t size() const {
+        auto head = dequeue_pos.load(std::memory_order_relaxed);
+        auto tail = enqueue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+    alignas(64) EventCount not_full;
+};
+
+#endif // MPMC_QUEUE_HPP
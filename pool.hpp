@@ -0,0 +1,146 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <cstddef>
+#include <new>
+
+// Per-thread free list of fixed-size blocks. Blocks may be released on a
+// different thread than the one that allocated them; each thread keeps at
+// most `Cached` spare blocks and hands the rest back to the global heap.
+template<size_t Size, size_t Align, size_t Cached = 256>
+class FreeList {
+public:
+    static void *allocate() {
+        auto &list = local();
+        if (list.head == nullptr)
+            return ::operator new(Size, std::align_val_t(Align));
+
+        auto node = list.head;
+        list.head = node->next;
+        list.count--;
+        return node;
+    }
+
+    static void deallocate(void *block) {
+        auto &list = local();
+        if (list.count >= Cached) {
+            ::operator delete(block, std::align_val_t(Align));
+            return;
+        }
+
+        list.head = new(block) Node{list.head};
+        list.count++;
+    }
+
+private:
+    static_assert(Size >= sizeof(void *), "block too small for a free list");
+
+    struct Node {
+        Node *next;
+    };
+
+    struct List {
+        Node *head{nullptr};
+        size_t count{0};
+
+        ~List() {
+            while (head != nullptr) {
+                auto next = head->next;
+                ::operator delete(head, std::align_val_t(Align));
+                head = next;
+            }
+        }
+    };
+
+    static List &local() {
+        thread_local List list;
+        return list;
+    }
+};
+
+// FreeLists for power-of-two block sizes from 16 to MaxSize bytes; a
+// request is served from the smallest class it fits into.
+template<size_t Align, size_t MaxSize = 1024>
+class SizeClasses {
+public:
+    static constexpr size_t max_size = MaxSize;
+
+    template<size_t Size = 16>
+    static void *allocate(size_t bytes) {
+        if constexpr (Size < MaxSize) {
+            if (bytes > Size) return allocate<Size * 2>(bytes);
+        }
+        return FreeList<Size, Align>::allocate();
+    }
+
+    template<size_t Size = 16>
+    static void deallocate(void *block, size_t bytes) {
+        if constexpr (Size < MaxSize) {
+            if (bytes > Size) return deallocate<Size * 2>(block, bytes);
+        }
+        FreeList<Size, Align>::deallocate(block);
+    }
+};
+
+// Stateless allocator drawing from FreeList. Single objects get a list of
+// their own size, meant for std::allocate_shared so that the object and its
+// control block are recycled together, and node-based containers. Small
+// arrays, e.g. vector storage, come from SizeClasses.
+template<typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        if (n == 1)
+            return static_cast<T *>(FreeList<sizeof(T), alignof(T)>::allocate());
+        if (n * sizeof(T) <= classes::max_size)
+            return static_cast<T *>(classes::allocate(n * sizeof(T)));
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+
+    void deallocate(T *block, size_t n) {
+        if (n == 1) {
+            FreeList<sizeof(T), alignof(T)>::deallocate(block);
+        } else if (n * sizeof(T) <= classes::max_size) {
+            classes::deallocate(block, n * sizeof(T));
+        } else {
+            ::operator delete(block, std::align_val_t(alignof(T)));
+        }
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U> &) const { return true; }
+
+private:
+    typedef SizeClasses<alignof(T)> classes;
+};
+
+// Base for classes whose objects are recycled through FreeList, e.g.
+// `class Burger : public Product, public Pooled<Burger>`: deleting one (a
+// collected product going out of scope, a machine dropping a returned one)
+// keeps the block for the next `new` on that thread. Objects of classes
+// derived further are allocated normally.
+template<typename T>
+class Pooled {
+public:
+    static void *operator new(size_t size) {
+        if (size != sizeof(T)) return ::operator new(size);
+        return FreeList<sizeof(T), alignof(T)>::allocate();
+    }
+
+    static void operator delete(void *block, size_t size) {
+        if (size != sizeof(T)) {
+            ::operator delete(block);
+            return;
+        }
+        FreeList<sizeof(T), alignof(T)>::deallocate(block);
+    }
+};
+
+#endif // POOL_HPP
@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "driver.hpp"
+#include "system.hpp"
+#include "trace.hpp"
+
+// Drives a System with the orders of a recorded trace (see trace.hpp) and
+// machines that take as long as the recorded ones did. Arguments are
+// --key=value pairs; --trace is required:
+//
+//   replay --trace=run.trace --speed=2 --workers=16 --dispatch-fairness=0
+//
+// Workers and client timeout default to the recorded ones. Prints one JSON
+// object comparing recorded and replayed order-to-ready latency.
+
+typedef std::chrono::steady_clock replay_clock;
+
+struct Options {
+    std::string trace;
+    std::string record;
+    double speed = 1;
+    unsigned int workers = 0;
+    unsigned int max_workers = 0;
+    unsigned int timeout_ms = 0;
+    unsigned int dispatch_fairness = 4;
+    unsigned int collectors = 32;
+
+    void set(const std::string &key, const std::string &value) {
+        if (key == "trace") trace = value;
+        else if (key == "record") record = value;
+        else if (key == "speed") speed = std::stod(value);
+        else if (key == "workers") workers = std::stoul(value);
+        else if (key == "max-workers") max_workers = std::stoul(value);
+        else if (key == "timeout-ms") timeout_ms = std::stoul(value);
+        else if (key == "dispatch-fairness") dispatch_fairness = std::stoul(value);
+        else if (key == "collectors") collectors = std::stoul(value);
+        else throw std::invalid_argument("unknown option --" + key);
+    }
+
+    std::string json() const {
+        std::ostringstream out;
+        out << "{\"trace\": \"" << trace << "\""
+            << ", \"speed\": " << speed
+            << ", \"workers\": " << workers
+            << ", \"max_workers\": " << max_workers
+            << ", \"timeout_ms\": " << timeout_ms
+            << ", \"dispatch_fairness\": " << dispatch_fairness
+            << ", \"collectors\": " << collectors << "}";
+        return out.str();
+    }
+};
+
+// What a recorded order asked for and how it ended.
+struct RecordedOrder {
+    uint64_t submitted_ns{};
+    Priority priority{};
+    uint64_t deadline_ns{};
+    std::vector<ProductId> products;
+    TraceEvent outcome{TraceEvent::SUBMITTED};
+    uint64_t outcome_ns{};
+};
+
+struct Fetch {
+    replay_clock::duration duration;
+    uint64_t items;
+};
+
+class ReplayProduct : public Product, public Pooled<ReplayProduct> {
+};
+
+// Replays the recorded fetches of one machine in a loop: each call takes as
+// long as the recorded one (divided by the speed-up) and fails where the
+// recorded one failed, handing out at most as many items as it did.
+// Returned items are handed out again first, without delay.
+class ReplayMachine : public Machine {
+    std::vector<Fetch> fetches;
+    std::mutex mutex;
+    size_t next{0};
+    size_t stock{0};
+
+public:
+    explicit ReplayMachine(std::vector<Fetch> fetches) : fetches(std::move(fetches)) {}
+
+    std::unique_ptr<Product> getProduct() override {
+        return std::move(getProducts(1).front());
+    }
+
+    std::vector<std::unique_ptr<Product>> getProducts(size_t n) override {
+        std::vector<std::unique_ptr<Product>> products;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (; stock > 0 && products.size() < n; stock--) {
+            products.push_back(std::make_unique<ReplayProduct>());
+        }
+        if (!products.empty() || fetches.empty()) {
+            if (products.empty()) products.push_back(std::make_unique<ReplayProduct>());
+            return products;
+        }
+
+        auto fetch = fetches[next++ % fetches.size()];
+        lock.unlock();
+        std::this_thread::sleep_for(fetch.duration);
+        if (fetch.items == 0) throw MachineFailure();
+        for (uint64_t i = 0; i < std::min<uint64_t>(n, fetch.items); i++) {
+            products.push_back(std::make_unique<ReplayProduct>());
+        }
+        return products;
+    }
+
+    void returnProduct(std::unique_ptr<Product>) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        stock++;
+    }
+
+    void start() override {}
+
+    void stop() override {}
+};
+
+struct Results {
+    LatencyHistogram recorded;
+    LatencyHistogram replayed;
+    std::atomic<unsigned long> submitted{0};
+    std::atomic<unsigned long> rejected{0};
+    std::atomic<unsigned long> collected{0};
+    std::atomic<unsigned long> failed{0};
+    std::atomic<unsigned long> abandoned{0};
+    std::atomic<unsigned long> cancelled{0};
+};
+
+struct InFlight {
+    std::unique_ptr<CoasterPager> pager;
+    replay_clock::time_point submitted;
+    const RecordedOrder *recorded;
+};
+
+// Ends an order the way the recorded one ended: collected once ready, or
+// left to expire. Recorded cancellations go to the Canceller instead.
+void finishOrder(System &system, Results &results, InFlight &order) {
+    try {
+        order.pager->wait();
+    }
+    catch (FulfillmentFailure &) {
+        results.failed++;
+        return;
+    }
+    results.replayed.record(replay_clock::now() - order.submitted);
+
+    if (order.recorded->outcome != TraceEvent::COLLECTED) {
+        results.abandoned++;
+        return;
+    }
+    try {
+        system.collectOrder(std::move(order.pager));
+        results.collected++;
+    }
+    catch (OrderExpiredException &) {
+        results.abandoned++;
+    }
+    catch (FulfillmentFailure &) {
+        results.failed++;
+    }
+}
+
+// Cancels orders as long after their submission as the recorded ones were
+// cancelled, earliest first, so an order waiting for its turn holds up no
+// other.
+class Canceller {
+    struct Cancellation {
+        replay_clock::time_point when;
+        std::unique_ptr<CoasterPager> pager;
+
+        bool operator>(const Cancellation &other) const { return when > other.when; }
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Cancellation> pending;
+    bool done{false};
+    std::thread thread;
+
+public:
+    Canceller(System &system, Results &results) {
+        thread = std::thread([this, &system, &results] {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                if (pending.empty()) {
+                    if (done) break;
+                    cv.wait(lock);
+                    continue;
+                }
+                if (replay_clock::now() < pending.front().when) {
+                    cv.wait_until(lock, pending.front().when);
+                    continue;
+                }
+
+                std::pop_heap(pending.begin(), pending.end(), std::greater<>());
+                auto pager = std::move(pending.back().pager);
+                pending.pop_back();
+                lock.unlock();
+                system.cancelOrder(std::move(pager));
+                results.cancelled++;
+                lock.lock();
+            }
+        });
+    }
+
+    void add(replay_clock::time_point when, std::unique_ptr<CoasterPager> pager) {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending.push_back({when, std::move(pager)});
+        std::push_heap(pending.begin(), pending.end(), std::greater<>());
+        cv.notify_one();
+    }
+
+    // Returns once every cancellation added has been made.
+    void finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_one();
+        lock.unlock();
+        thread.join();
+    }
+};
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) return 1;
+    Trace trace;
+    try {
+        if (options.trace.empty()) throw std::invalid_argument("--trace is required");
+        if (options.speed <= 0) throw std::invalid_argument("--speed must be positive");
+        trace = readTrace(options.trace);
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (options.workers == 0) options.workers = trace.workers;
+    if (options.timeout_ms == 0) options.timeout_ms = trace.client_timeout_ms;
+    auto scaled = [&options](uint64_t ns) {
+        return std::chrono::nanoseconds((uint64_t) ((double) ns / options.speed));
+    };
+
+    Results results;
+    std::map<uint32_t, RecordedOrder> orders;
+    std::vector<std::vector<Fetch>> fetches(trace.products.size());
+    std::vector<uint64_t> fetch_started(trace.products.size());
+    for (auto &record: trace.records) {
+        auto order = orders.find(record.order);
+        switch (record.event) {
+            case TraceEvent::SUBMITTED:
+                orders[record.order].submitted_ns = record.time_ns;
+                orders[record.order].priority = Priority(record.priority);
+                orders[record.order].deadline_ns = record.value;
+                break;
+            case TraceEvent::ITEM:
+                if (order != orders.end())
+                    order->second.products.push_back(ProductId(record.product));
+                break;
+            case TraceEvent::FETCH_STARTED:
+                fetch_started[record.product] = record.time_ns;
+                break;
+            case TraceEvent::FETCH_FINISHED:
+                fetches[record.product].push_back(
+                        {scaled(record.time_ns - fetch_started[record.product]), record.value});
+                break;
+            case TraceEvent::READY:
+                if (order != orders.end())
+                    results.recorded.record(record.time_ns - order->second.submitted_ns);
+                break;
+            case TraceEvent::FAILED:
+            case TraceEvent::COLLECTED:
+            case TraceEvent::EXPIRED:
+            case TraceEvent::CANCELLED:
+                if (order != orders.end()) {
+                    order->second.outcome = record.event;
+                    order->second.outcome_ns = record.time_ns;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    std::erase_if(orders, [](const auto &entry) { return entry.second.products.empty(); });
+
+    System::machines_t machines;
+    for (unsigned int i = 0; i < trace.products.size(); i++) {
+        machines.emplace(trace.products[i], std::make_shared<ReplayMachine>(std::move(fetches[i])));
+    }
+    System system{machines, options.workers, options.timeout_ms, options.dispatch_fairness,
+                  options.max_workers};
+    if (!options.record.empty()) system.startTrace(options.record);
+
+    std::vector<std::unique_ptr<Collector<InFlight>>> collectors;
+    for (unsigned int i = 0; i < std::max(options.collectors, 1u); i++) {
+        collectors.push_back(std::make_unique<Collector<InFlight>>(
+                [&system, &results](InFlight &order) { finishOrder(system, results, order); }));
+    }
+    Canceller canceller(system, results);
+
+    std::vector<const RecordedOrder *> schedule;
+    for (auto &[id, order]: orders) {
+        schedule.push_back(&order);
+    }
+    std::stable_sort(schedule.begin(), schedule.end(), [](auto a, auto b) {
+        return a->submitted_ns < b->submitted_ns;
+    });
+
+    auto first = schedule.empty() ? 0 : schedule.front()->submitted_ns;
+    auto start = replay_clock::now();
+    size_t next_collector = 0;
+    for (auto order: schedule) {
+        std::this_thread::sleep_until(start + scaled(order->submitted_ns - first));
+        try {
+            InFlight in_flight{system.order(order->products, order->priority,
+                                            scaled(order->deadline_ns)),
+                               replay_clock::now(), order};
+            results.submitted++;
+            if (order->outcome == TraceEvent::CANCELLED) {
+                canceller.add(in_flight.submitted + scaled(order->outcome_ns - order->submitted_ns),
+                              std::move(in_flight.pager));
+                continue;
+            }
+            collectors[next_collector++ % collectors.size()]->add(std::move(in_flight));
+        }
+        catch (std::exception &) {
+            results.rejected++;
+        }
+    }
+
+    for (auto &collector: collectors) {
+        collector->finish();
+    }
+    canceller.finish();
+    auto elapsed = std::chrono::duration<double>(replay_clock::now() - start).count();
+    system.shutdown();
+
+    std::cout << "{\"config\": " << options.json()
+              << ", \"elapsed_s\": " << elapsed
+              << ", \"submitted\": " << results.submitted
+              << ", \"rejected\": " << results.rejected
+              << ", \"collected\": " << results.collected
+              << ", \"failed\": " << results.failed
+              << ", \"abandoned\": " << results.abandoned
+              << ", \"cancelled\": " << results.cancelled
+              << ", \"recorded_order_to_ready_us\": " << histogramJson(results.recorded)
+              << ", \"replayed_order_to_ready_us\": " << histogramJson(results.replayed)
+              << "}" << std::endl;
+}
@@ -0,0 +1,140 @@
+#ifndef STATIC_SYSTEM_HPP
+#define STATIC_SYSTEM_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "system.hpp"
+
+// Product name usable as a template argument, e.g. MenuItem<"burger", ...>.
+template<size_t N>
+struct ProductName {
+    char value[N]{};
+
+    constexpr ProductName(const char (&name)[N]) {
+        std::copy_n(name, N, value);
+    }
+
+    [[nodiscard]] constexpr std::string_view view() const { return {value, N - 1}; }
+};
+
+template<ProductName Name, typename M>
+struct MenuItem {
+    typedef M machine_type;
+    static constexpr std::string_view name = Name.view();
+};
+
+// System over a menu fixed at build time:
+//
+//   StaticSystem<MenuItem<"burger", BurgerMachine>, MenuItem<"chips", ChipsMachine>>
+//
+// Machines are kept in a tuple with their own types and the fetchers reach
+// them through MachineAccess::of<M>(), not the virtual Machine interface.
+// Product names resolve to ProductIds at compile time, and
+// order<"burger", "chips">() submits without looking names up.
+template<typename... Items>
+class StaticSystem {
+public:
+    typedef std::tuple<std::shared_ptr<typename Items::machine_type>...> machines_t;
+
+    static constexpr std::array<std::string_view, sizeof...(Items)> names{Items::name...};
+
+    template<ProductName Name>
+    static constexpr size_t indexOf() {
+        static_assert(find(Name.view()) < names.size(), "product not on the menu");
+        return find(Name.view());
+    }
+
+    // System numbers products in name order.
+    template<ProductName Name>
+    static constexpr ProductId id() {
+        indexOf<Name>();
+        unsigned int rank = 0;
+        for (auto name: names) {
+            if (name < Name.view()) rank++;
+        }
+        return ProductId(rank);
+    }
+
+    explicit StaticSystem(unsigned int numberOfWorkers, unsigned int clientTimeout,
+                          unsigned int dispatchFairness = 4, unsigned int maxWorkers = 0) :
+            StaticSystem(machines_t{std::make_shared<typename Items::machine_type>()...},
+                         numberOfWorkers, clientTimeout, dispatchFairness, maxWorkers) {}
+
+    StaticSystem(machines_t machines, unsigned int numberOfWorkers,
+                 unsigned int clientTimeout, unsigned int dispatchFairness = 4,
+                 unsigned int maxWorkers = 0) :
+            machines(std::move(machines)),
+            dynamic(menuOf(this->machines),
+                    System::access_t{{std::string(Items::name),
+                                      MachineAccess::of<typename Items::machine_type>()}...},
+                    numberOfWorkers, clientTimeout, dispatchFairness, maxWorkers) {
+        static_assert(unique(), "product names must be unique");
+    }
+
+    template<ProductName Name>
+    auto &machine() { return *std::get<indexOf<Name>()>(machines); }
+
+    template<ProductName... Products>
+    std::unique_ptr<CoasterPager>
+    order(Priority priority = Priority::NORMAL,
+          std::chrono::steady_clock::duration deadline = {}) {
+        return dynamic.order(std::vector<ProductId>{id<Products>()...}, priority, deadline);
+    }
+
+    std::unique_ptr<CoasterPager>
+    order(std::vector<std::string> products, Priority priority = Priority::NORMAL,
+          std::chrono::steady_clock::duration deadline = {}) {
+        return dynamic.order(std::move(products), priority, deadline);
+    }
+
+    std::vector<std::unique_ptr<Product>>
+    collectOrder(std::unique_ptr<CoasterPager> CoasterPager) {
+        return dynamic.collectOrder(std::move(CoasterPager));
+    }
+
+    std::vector<WorkerReport> shutdown() { return dynamic.shutdown(); }
+
+    std::vector<std::string> getMenu() const { return dynamic.getMenu(); }
+
+    std::vector<unsigned int> getPendingOrders() const { return dynamic.getPendingOrders(); }
+
+    unsigned int getClientTimeout() const { return dynamic.getClientTimeout(); }
+
+    SystemStats stats() const { return dynamic.stats(); }
+
+    // The rest of the System API.
+    System &system() { return dynamic; }
+
+private:
+    machines_t machines;
+    System dynamic;
+
+    static constexpr size_t find(std::string_view product) {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == product) return i;
+        }
+        return names.size();
+    }
+
+    static constexpr bool unique() {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (find(names[i]) != i) return false;
+        }
+        return true;
+    }
+
+    static System::machines_t menuOf(const machines_t &machines) {
+        return std::apply([](const auto &...machine) {
+            return System::machines_t{{std::string(Items::name), machine}...};
+        }, machines);
+    }
+};
+
+#endif // STATIC_SYSTEM_HPP
@@ -0,0 +1,177 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Log-linear histogram (HDR style): values below 8 get a bucket each, every
+// further power of two is split into 8 sub-buckets, so a bucket is at most
+// 12.5% wide. Recording is two relaxed additions and, for a new maximum, a
+// compare-and-swap; meant to be written by one thread (or a few) and read by
+// snapshots.
+class LatencyHistogram {
+public:
+    static constexpr unsigned int sub_buckets = 8;
+    static constexpr unsigned int buckets = (64 - 2) * sub_buckets;
+
+    static unsigned int bucketOf(uint64_t value) {
+        if (value < sub_buckets) return (unsigned int) value;
+        unsigned int exponent = 63 - std::countl_zero(value);
+        unsigned int sub = (value >> (exponent - 3)) & (sub_buckets - 1);
+        return (exponent - 2) * sub_buckets + sub;
+    }
+
+    static uint64_t upperBoundOf(unsigned int bucket) {
+        if (bucket < sub_buckets) return bucket;
+        unsigned int exponent = bucket / sub_buckets + 2;
+        uint64_t sub = bucket % sub_buckets;
+        return ((sub_buckets + sub + 1) << (exponent - 3)) - 1;
+    }
+
+    void record(uint64_t value) {
+        counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        auto seen = max.load(std::memory_order_relaxed);
+        while (value > seen &&
+               !max.compare_exchange_weak(seen, value, std::memory_order_relaxed));
+    }
+
+    void record(std::chrono::steady_clock::duration duration) {
+        record((uint64_t) std::max<int64_t>(
+                0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+    }
+
+    void addTo(std::vector<uint64_t> &totals, uint64_t &total, uint64_t &maximum) const {
+        totals.resize(buckets);
+        for (unsigned int i = 0; i < buckets; i++) {
+            totals[i] += counts[i].load(std::memory_order_relaxed);
+        }
+        total += sum.load(std::memory_order_relaxed);
+        maximum = std::max(maximum, max.load(std::memory_order_relaxed));
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, buckets> counts{};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+// Merged view of one or more LatencyHistograms, values in nanoseconds.
+struct HistogramSnapshot {
+    std::vector<uint64_t> counts;
+    uint64_t count{0};
+    uint64_t sum{0};
+    uint64_t max{0};
+
+    void add(const LatencyHistogram &histogram) {
+        histogram.addTo(counts, sum, max);
+        count = 0;
+        for (auto bucket: counts) count += bucket;
+    }
+
+    [[nodiscard]] double mean() const {
+        return count == 0 ? 0 : (double) sum / (double) count;
+    }
+
+    [[nodiscard]] uint64_t percentile(double q) const {
+        if (count == 0) return 0;
+        auto rank = (uint64_t) (q * (double) count);
+        uint64_t seen = 0;
+        for (unsigned int i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen > rank) return std::min(LatencyHistogram::upperBoundOf(i), max);
+        }
+        return max;
+    }
+};
+
+// One padded copy of T per thread stripe; threads are spread round-robin.
+template<typename T, size_t Stripes = 16>
+class Striped {
+public:
+    T &local() {
+        static std::atomic<size_t> next{0};
+        thread_local size_t stripe = next.fetch_add(1) % Stripes;
+        return slots[stripe].value;
+    }
+
+    template<typename F>
+    void forEach(F f) const {
+        for (auto &slot: slots) f(slot.value);
+    }
+
+private:
+    struct alignas(64) Slot {
+        T value;
+    };
+
+    std::array<Slot, Stripes> slots;
+};
+
+// Circuit breaker state of a machine: CLOSED serves requests, OPEN fails
+// them without calling the machine, HALF_OPEN is a probe in progress.
+enum class MachineHealth : unsigned char {
+    CLOSED,
+    OPEN,
+    HALF_OPEN
+};
+
+struct MachineStats {
+    std::string product;
+    size_t queue_depth{};
+    bool on_menu{};
+    MachineHealth health{};
+    uint64_t fetched{};
+    uint64_t failed{};
+    uint64_t fast_failed{};
+    uint64_t probes{};
+    uint64_t returned{};
+    uint64_t prefetched{};
+    uint64_t served_from_stock{};
+    size_t stock{};
+    HistogramSnapshot fetch_latency;
+};
+
+struct WorkerStats {
+    bool active{};
+    uint64_t orders{};
+    std::chrono::nanoseconds busy{};
+    std::chrono::nanoseconds idle{};
+};
+
+// Orders finished (ready or failed) in one priority class; `missed` counts
+// those that finished after their deadline.
+struct PriorityStats {
+    uint64_t orders{};
+    uint64_t with_deadline{};
+    uint64_t missed{};
+    HistogramSnapshot latency;
+};
+
+struct SystemStats {
+    std::vector<MachineStats> machines;
+    std::vector<WorkerStats> workers;
+    std::vector<PriorityStats> priorities;
+    unsigned int active_workers{};
+    size_t pending_orders{};
+    size_t registered_orders{};
+    uint64_t ready_orders{};
+    uint64_t failed_orders{};
+    uint64_t collected_orders{};
+    uint64_t expired_orders{};
+    uint64_t rejected_orders{};
+    uint64_t cancelled_orders{};
+    uint64_t trace_dropped{};
+    HistogramSnapshot queued;
+    HistogramSnapshot preparing;
+    HistogramSnapshot collected;
+    HistogramSnapshot expired;
+};
+
+#endif // STATS_HPP
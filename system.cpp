@@ -1,4 +1,5 @@
 #include <exception>
+#include <tuple>
 #include <utility>
 #include <vector>
 #include <mutex>
@@ -6,221 +7,1117 @@
 #include <chrono>
 #include <functional>
 #include <future>
-#include <set>
+#include <climits>
 #include <algorithm>
+#include <bit>
+#include <cmath>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "system.hpp"
 
+static_assert(sizeof(std::atomic<OrderStatus>) == sizeof(int),
+              "order status must be futex-sized");
+
+void *CoasterPager::operator new(size_t size) {
+    if (size != sizeof(CoasterPager)) return ::operator new(size);
+    return FreeList<sizeof(CoasterPager), alignof(CoasterPager)>::allocate();
+}
+
+void CoasterPager::operator delete(void *block, size_t size) {
+    if (size != sizeof(CoasterPager)) return ::operator delete(block);
+    FreeList<sizeof(CoasterPager), alignof(CoasterPager)>::deallocate(block);
+}
+
+void CoasterPager::await(
+        const std::chrono::steady_clock::time_point *deadline) const {
+    while (status->load() == OrderStatus::IN_PROGRES) {
+        awaited->store(true);
+#ifdef __linux__
+        timespec timeout{}, *timeout_ptr = nullptr;
+        if (deadline != nullptr) {
+            auto left = *deadline - std::chrono::steady_clock::now();
+            if (left <= std::chrono::nanoseconds::zero()) return;
+            auto seconds = std::chrono::duration_cast<std::chrono::seconds>(left);
+            timeout.tv_sec = seconds.count();
+            timeout.tv_nsec = (left - seconds).count();
+            timeout_ptr = &timeout;
+        }
+        syscall(SYS_futex, status.get(), FUTEX_WAIT_PRIVATE,
+                OrderStatus::IN_PROGRES, timeout_ptr, nullptr, 0);
+#else
+        if (deadline == nullptr) {
+            status->wait(OrderStatus::IN_PROGRES);
+        } else {
+            if (std::chrono::steady_clock::now() >= *deadline) return;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+#endif
+    }
+}
+
 void CoasterPager::wait() const {
-    std::unique_lock<std::mutex> lock(mut);
-    cv->wait(lock, [this] { return *status != OrderStatus::IN_PROGRES; });
+    await(nullptr);
 
-    if (*status == OrderStatus::FAILED) throw FulfillmentFailure();
+    if (status->load() == OrderStatus::FAILED) throw FulfillmentFailure();
 }
 
 void CoasterPager::wait(unsigned int timeout) const {
-    std::unique_lock<std::mutex> lock(mut);
-    auto now = std::chrono::system_clock::now();
-    std::chrono::milliseconds time(timeout);
-    cv->wait_until(lock, now + time,
-                   [this] { return *status != OrderStatus::IN_PROGRES; });
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout);
+    await(&deadline);
 
-    if (*status == OrderStatus::FAILED) throw FulfillmentFailure();
+    if (status->load() == OrderStatus::FAILED) throw FulfillmentFailure();
 }
 
 unsigned int CoasterPager::getId() const { return id; }
 
-bool CoasterPager::isReady() const { return *status == OrderStatus::READY; }
-
-void System::collectProduct(unsigned int order_id, unsigned int my_id,
-                            std::string &product_name,
-                            WorkerReport &report,
-                            std::vector<std::pair<std::string, std::unique_ptr<Product>>> &collecting,
-                            std::mutex &mutex) {
-    std::unique_lock<std::mutex> lock(machines_data[product_name]->mut);
-
-    if (machines_data[product_name]->waiting.empty() ||
-        machines_data[product_name]->waiting.front() !=
-        std::make_pair(order_id, my_id))
-        machines_data[product_name]->cv.wait(lock, [&, this] {
-            return machines_data[product_name]->waiting.empty() ||
-                   machines_data[product_name]->waiting.front() !=
-                   std::make_pair(order_id, my_id);
-        });
+bool CoasterPager::isReady() const {
+    return status->load() == OrderStatus::READY;
+}
+
+// Skips the wake-up unless a pager ever waited on the order. Both sides use
+// sequentially consistent accesses, so either the waiter sees the new status
+// before sleeping or this sees its flag.
+void System::setStatus(OrderData &order, OrderStatus status) {
+    order.status.store(status);
+    if (!order.awaited.load()) return;
+#ifdef __linux__
+    syscall(SYS_futex, &order.status, FUTEX_WAKE_PRIVATE, INT_MAX,
+            nullptr, nullptr, 0);
+#else
+    order.status.notify_all();
+#endif
+}
+
+std::vector<std::string>
+System::productNames(const std::vector<ProductId> &products) const {
+    std::vector<std::string> result;
+    result.reserve(products.size());
+    for (auto product: products) {
+        result.push_back(product_names[(unsigned int) product]);
+    }
+
+    return result;
+}
+
+bool System::deliver(FetchCompletion &completion, ProductId product,
+                     std::unique_ptr<Product> &item) {
+    std::unique_lock<std::mutex> lock(completion.mut);
+    bool wanted = !completion.aborted;
+    if (wanted) completion.collected.emplace_back(product, std::move(item));
+    if (--completion.remaining == 0) completion.cv.notify_one();
+    lock.unlock();
+
+    return wanted;
+}
+
+bool System::skip(FetchCompletion &completion) {
+    std::unique_lock<std::mutex> lock(completion.mut);
+    if (!completion.aborted) return false;
+    if (--completion.remaining == 0) completion.cv.notify_one();
+    lock.unlock();
+
+    return true;
+}
+
+void System::fail(FetchCompletion &completion, ProductId product) {
+    std::unique_lock<std::mutex> lock(completion.mut);
+    completion.failed.push_back(product);
+    completion.aborted = true;
+    completion.remaining--;
+    completion.cv.notify_one();
+    lock.unlock();
+}
+
+void System::withdraw(ProductId product, FetchCompletion &completion) {
+    auto &data = *machines_data[(unsigned int) product];
+    std::unique_lock<std::mutex> lock(data.mut);
+    auto removed = std::erase_if(data.waiting, [&completion](const FetchRequest &request) {
+        return request.completion.get() == &completion;
+    });
+    if (removed == 0) return;
+    std::make_heap(data.waiting.begin(), data.waiting.end(), std::greater<>());
+    data.backlog.fetch_sub(removed, std::memory_order_relaxed);
+    lock.unlock();
+
+    std::unique_lock<std::mutex> lock2(completion.mut);
+    completion.remaining -= removed;
+    lock2.unlock();
+}
+
+void System::trip(ProductId product, MachineData &data) {
+    data.health.store(MachineHealth::OPEN);
+    data.retry_at = std::chrono::steady_clock::now() + std::chrono::steady_clock::duration(
+            probe_interval.load(std::memory_order_relaxed));
+    menu[(unsigned int) product].store(false);
+}
 
+void System::probe(ProductId product, MachineData &data) {
+    data.health.store(MachineHealth::HALF_OPEN);
+    data.probes.fetch_add(1, std::memory_order_relaxed);
+    std::vector<std::unique_ptr<Product>> items;
     try {
-        auto product = machines[product_name]->getProduct();
-        std::unique_lock<std::mutex> lock2(mutex);
-        collecting.emplace_back(product_name, std::move(product));
-        lock2.unlock();
+        items = getFrom(product, 1);
     }
     catch (...) {
-        std::unique_lock<std::mutex> lock2(menu_mutex);
-        menu.erase(product_name);
-        lock2.unlock();
-        std::unique_lock<std::mutex> lock3(mutex);
-        report.failedProducts.push_back(product_name);
-        lock3.unlock();
     }
 
-    machines_data[product_name]->waiting.pop();
-    machines_data[product_name]->cv.notify_all();
+    if (items.empty()) {
+        trip(product, data);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(machines_mutex);
+    returnTo(product, std::move(items));
+    lock.unlock();
+
+    data.health.store(MachineHealth::CLOSED);
+    menu[(unsigned int) product].store(true);
 }
 
-void System::run() {
-    WorkerReport report;
+void System::serveFromStock(ProductId product, MachineData &data,
+                            std::vector<std::shared_ptr<FetchCompletion>> &requests,
+                            size_t &served) {
+    while (!data.stock.empty() && served < requests.size()) {
+        if (deliver(*requests[served++], product, data.stock.back())) {
+            data.stock.pop_back();
+            data.served_from_stock.fetch_add(1, std::memory_order_relaxed);
+        }
+        data.backlog.fetch_sub(1, std::memory_order_relaxed);
+    }
+    data.stocked.store(data.stock.size(), std::memory_order_relaxed);
+}
 
-    while (!(!is_open && pending_orders.empty())) {
-        std::vector<std::pair<std::string, std::unique_ptr<Product>>> collecting;
-        std::mutex mutex;
-        std::unique_lock<std::mutex> lock(pending_orders_mutex);
-        pending_orders_cv.wait(lock,
-                               [this] { return !pending_orders.empty(); });
+// The expected demand is a moving average of the items requested per window;
+// requests served while the fetcher was busy for several windows count as
+// spread over them. Stock above the expected demand goes back to the machine.
+void System::restock(ProductId product, MachineData &data) {
+    auto limit = prefetch_limit.load(std::memory_order_relaxed);
+    auto window = std::chrono::steady_clock::duration(
+            prefetch_window.load(std::memory_order_relaxed));
+    if (limit == 0 || window <= window.zero()) return;
 
-        auto id = pending_orders.front();
+    auto now = std::chrono::steady_clock::now();
+    if (now - data.window_start >= window) {
+        auto windows = (now - data.window_start) / window;
+        data.expected_demand = (3 * data.expected_demand +
+                                (double) data.demand / (double) windows) / 4;
+        data.demand = 0;
+        data.window_start = now;
+    }
 
-        if (id == -1) break;
+    auto target = std::min(limit, (size_t) std::ceil(data.expected_demand));
+    if (data.stock.size() > target) {
+        std::vector<std::unique_ptr<Product>> surplus;
+        for (; data.stock.size() > target; data.stock.pop_back()) {
+            surplus.push_back(std::move(data.stock.back()));
+        }
+        data.stocked.store(data.stock.size(), std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(machines_mutex);
+        returnTo(product, std::move(surplus));
+        lock.unlock();
+        return;
+    }
+    if (data.stock.size() == target || data.health.load() != MachineHealth::CLOSED) return;
 
-        pending_orders.pop_front();
-        auto products = std::move(orders_products[id]);
+    std::vector<std::unique_ptr<Product>> items;
+    try {
+        items = getFrom(product, target - data.stock.size());
+    }
+    catch (...) {
+    }
+
+    if (items.empty()) {
+        data.failed.fetch_add(1, std::memory_order_relaxed);
+        trip(product, data);
+        return;
+    }
+
+    data.prefetched.fetch_add(items.size(), std::memory_order_relaxed);
+    for (auto &item: items) {
+        data.stock.push_back(std::move(item));
+    }
+    data.stocked.store(data.stock.size(), std::memory_order_relaxed);
+}
+
+// Requests are served from the prefetched stock first. Requests of orders
+// that already failed are dropped without fetching for them; once the
+// machine fails, the remaining requests fail without calling it again.
+void System::collectProducts(
+        ProductId product,
+        std::vector<std::shared_ptr<FetchCompletion>> &requests) {
+    auto &data = *machines_data[(unsigned int) product];
+    std::vector<std::unique_ptr<Product>> spare;
+    size_t served = 0;
+    while (served < requests.size()) {
+        for (; served < requests.size() && skip(*requests[served]); served++) {
+            data.backlog.fetch_sub(1, std::memory_order_relaxed);
+        }
+        serveFromStock(product, data, requests, served);
+        if (served == requests.size()) break;
+
+        if (data.health.load() != MachineHealth::CLOSED) {
+            data.fast_failed.fetch_add(requests.size() - served, std::memory_order_relaxed);
+            for (; served < requests.size(); served++) {
+                fail(*requests[served], product);
+                data.backlog.fetch_sub(1, std::memory_order_relaxed);
+            }
+            break;
+        }
 
-        unsigned int thread_id = 0;
-        std::vector<std::thread> threads;
-        for (auto &product: products) {
-            machines_data[product]->waiting.emplace(id, thread_id);
-            std::thread thread{
-                    [id, thread_id, &product, &report, &collecting, &mutex, this] {
-                        collectProduct(id, thread_id, product, report,
-                                       collecting, mutex);
-                    }};
-            threads.emplace_back(std::move(thread));
-            thread_id++;
+        tracer.record(TraceEvent::FETCH_STARTED, trace_no_order, (uint16_t) product,
+                      requests.size() - served);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::unique_ptr<Product>> items;
+        try {
+            items = getFrom(product, requests.size() - served);
         }
+        catch (...) {
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        tracer.record(TraceEvent::FETCH_FINISHED, trace_no_order, (uint16_t) product,
+                      items.size());
+        data.fetch_latency.record(elapsed);
 
+        if (items.empty()) {
+            data.failed.fetch_add(1, std::memory_order_relaxed);
+            fail(*requests[served++], product);
+            data.backlog.fetch_sub(1, std::memory_order_relaxed);
+            trip(product, data);
+            continue;
+        }
+
+        smooth(data.item_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                elapsed).count() / items.size());
+        data.fetched.fetch_add(items.size(), std::memory_order_relaxed);
+        for (auto &item: items) {
+            while (item != nullptr && served < requests.size()) {
+                deliver(*requests[served++], product, item);
+                data.backlog.fetch_sub(1, std::memory_order_relaxed);
+            }
+            if (item != nullptr) spare.push_back(std::move(item));
+        }
+    }
+
+    if (!spare.empty()) {
+        std::unique_lock<std::mutex> lock(machines_mutex);
+        returnTo(product, std::move(spare));
         lock.unlock();
+    }
+}
 
-        for (auto &thread: threads) {
-            thread.join();
+void System::fetch(ProductId product, MachineData &data) {
+    std::vector<std::shared_ptr<FetchCompletion>> requests;
+    uint64_t batches = 0;
+    while (true) {
+        std::unique_lock<std::mutex> lock(data.mut);
+        auto ready = [&data] { return data.closing || !data.waiting.empty(); };
+        auto probing = [this, &data] {
+            return data.health.load() == MachineHealth::OPEN &&
+                   probe_interval.load(std::memory_order_relaxed) > 0;
+        };
+        auto prefetching = [this] {
+            return prefetch_limit.load(std::memory_order_relaxed) > 0;
+        };
+        auto wake = std::chrono::steady_clock::time_point::max();
+        if (probing()) wake = data.retry_at;
+        if (prefetching()) {
+            wake = std::min(wake, data.window_start + std::chrono::steady_clock::duration(
+                    prefetch_window.load(std::memory_order_relaxed)));
         }
+        if (wake != std::chrono::steady_clock::time_point::max())
+            data.cv.wait_until(lock, wake, ready);
+        else
+            data.cv.wait(lock, [&] { return ready() || probing() || prefetching(); });
 
-        std::unique_lock<std::mutex> lock2(orders_mutex);
-        *orders_data[id]->status = (collecting.size() == products.size()) ? OrderStatus::READY : OrderStatus::FAILED;
+        if (data.waiting.empty()) {
+            if (data.closing) break;
+            lock.unlock();
+            if (probing() && std::chrono::steady_clock::now() >= data.retry_at)
+                probe(product, data);
+            else
+                restock(product, data);
+            continue;
+        }
 
-        orders_data[id]->pager_cv->notify_all();
+        // Every aging_interval-th batch that does not take all the waiting
+        // requests anyway starts with the oldest one, so a request waits for
+        // at most aging_interval batches per older one. It is lifted to the
+        // top of the heap and popped from there.
+        if (++batches % aging_interval == 0 && data.waiting.size() > fetch_batch_limit) {
+            auto oldest = std::min_element(data.waiting.begin(), data.waiting.end(),
+                                           [](const FetchRequest &a, const FetchRequest &b) {
+                                               return a.id < b.id;
+                                           });
+            requests.push_back(std::move(oldest->completion));
+            *oldest = {Priority::HIGH, std::chrono::steady_clock::time_point::min(), 0, nullptr};
+            std::push_heap(data.waiting.begin(), oldest + 1, std::greater<>());
+            std::pop_heap(data.waiting.begin(), data.waiting.end(), std::greater<>());
+            data.waiting.pop_back();
+        }
+        while (!data.waiting.empty() && requests.size() < fetch_batch_limit) {
+            std::pop_heap(data.waiting.begin(), data.waiting.end(), std::greater<>());
+            requests.push_back(std::move(data.waiting.back().completion));
+            data.waiting.pop_back();
+        }
+        lock.unlock();
+        data.demand += requests.size();
 
-        auto now = std::chrono::system_clock::now();
-        std::chrono::milliseconds time(clientTimeout);
-        bool collection = true;
-        if (*orders_data[id]->status == OrderStatus::READY)
-            collection = orders_data[id]->cv.wait_until(lock2, now + time,
-                                                         [this, id] {
-                                                             return orders_data[id]->client_collecting;
-                                                         });
+        collectProducts(product, requests);
+        requests.clear();
+    }
 
-        if (!collection) *orders_data[id]->status = OrderStatus::EXPIRED;
-        if (*orders_data[id]->status == OrderStatus::READY) {
-            for (auto &pair: collecting) {
-                orders_data[id]->completed.push_back(std::move(pair.second));
-            }
+    if (!data.stock.empty()) {
+        data.returned.fetch_add(data.stock.size(), std::memory_order_relaxed);
+        tracer.record(TraceEvent::RETURNED, trace_no_order, (uint16_t) product,
+                      data.stock.size());
+        std::unique_lock<std::mutex> lock(machines_mutex);
+        returnTo(product, std::move(data.stock));
+        lock.unlock();
+        data.stock.clear();
+        data.stocked.store(0, std::memory_order_relaxed);
+    }
+}
+
+std::vector<std::unique_ptr<Product>> System::getFrom(ProductId product, size_t n) {
+    return access[(unsigned int) product].getProducts(*machines[(unsigned int) product], n);
+}
+
+void System::returnTo(ProductId product, std::vector<std::unique_ptr<Product>> products) {
+    access[(unsigned int) product].returnProducts(*machines[(unsigned int) product],
+                                                  std::move(products));
+}
+
+void System::returnProducts(collected_t &products) {
+    std::sort(products.begin(), products.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    std::unique_lock<std::mutex> lock(machines_mutex);
+    for (size_t i = 0; i < products.size();) {
+        auto product = products[i].first;
+        std::vector<std::unique_ptr<Product>> batch;
+        for (; i < products.size() && products[i].first == product; i++) {
+            batch.push_back(std::move(products[i].second));
         }
+        machines_data[(unsigned int) product]->returned.fetch_add(
+                batch.size(), std::memory_order_relaxed);
+        tracer.record(TraceEvent::RETURNED, trace_no_order, (uint16_t) product,
+                      batch.size());
+        returnTo(product, std::move(batch));
+    }
+    lock.unlock();
+}
+
+System::OrderShard &System::shardOf(unsigned int id) {
+    return orders_data[id % order_shards];
+}
+
+void System::expireOrder(unsigned int id) {
+    auto &shard = shardOf(id);
+    std::unique_lock<std::mutex> lock(shard.mut);
+    auto order = shard.orders.find(id);
+    if (order == shard.orders.end() ||
+        order->second->status.load() != OrderStatus::READY)
+        return;
+
+    setStatus(*order->second, OrderStatus::EXPIRED);
+    tracer.record(TraceEvent::EXPIRED, id);
+    auto &counters = order_stats.local();
+    counters.expired.fetch_add(1, std::memory_order_relaxed);
+    counters.expired_after.record(std::chrono::steady_clock::now() -
+                                  order->second->ready);
+    auto collecting = std::move(order->second->completed);
+    auto products = std::move(order->second->products);
+    auto worker = order->second->worker;
+    lock.unlock();
+
+    report(worker, ReportKind::ABANDONED, id, std::move(products));
+
+    returnProducts(collecting);
+    schedule(id, true);
+}
+
+void System::reclaimOrder(unsigned int id) {
+    auto &shard = shardOf(id);
+    std::unique_lock<std::mutex> lock(shard.mut);
+    auto order = shard.orders.find(id);
+    if (order == shard.orders.end()) return;
 
-        orders_data[id]->ready_to_collect = true;
-        orders_data[id]->collect_cv.notify_all();
+    auto status = order->second->status.load();
+    if (status == OrderStatus::FAILED || status == OrderStatus::EXPIRED)
+        shard.orders.erase(order);
+}
+
+void System::schedule(unsigned int id, bool reclaim) {
+    std::unique_lock<std::mutex> lock(deadlines_mutex);
+    deadlines.push({std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(clientTimeout), id, reclaim});
+    deadlines_cv.notify_one();
+    lock.unlock();
+}
+
+void System::expire() {
+    std::unique_lock<std::mutex> lock(deadlines_mutex);
+    while (true) {
+        deadlines_cv.wait(lock, [this] {
+            return deadlines_closing || !deadlines.empty();
+        });
+
+        if (deadlines.empty()) break;
 
-        OrderStatus status = *orders_data[id]->status;
+        auto deadline = deadlines.top();
+        if (!(deadline.reclaim && deadlines_closing) &&
+            deadlines_cv.wait_until(lock, deadline.when, [this, &deadline] {
+                return deadlines.top().when < deadline.when ||
+                       (deadline.reclaim && deadlines_closing);
+            }))
+            continue;
 
+        deadlines.pop();
+        lock.unlock();
+        if (deadline.reclaim) reclaimOrder(deadline.id);
+        else expireOrder(deadline.id);
         lock.lock();
-        orders_in_progress.erase(id);
+    }
+}
+
+// Called at submission, before the order is in a lane, so each machine
+// queues the requests of one priority in the order they were submitted, and
+// a cancelled order has its requests withdrawn by cancelOrder. Machines serve
+// their queues by (priority, deadline, id).
+void System::dispatch(const OrderData &order, std::shared_ptr<FetchCompletion> completion) {
+    for (auto &product: order.products) {
+        auto &data = *machines_data[(unsigned int) product];
+        std::unique_lock<std::mutex> lock(data.mut);
+        data.waiting.push_back({order.priority, order.deadline, order.id, completion});
+        std::push_heap(data.waiting.begin(), data.waiting.end(), std::greater<>());
+        data.backlog.fetch_add(1, std::memory_order_relaxed);
+        data.cv.notify_one();
         lock.unlock();
+        tracer.record(TraceEvent::FETCH_QUEUED, order.id, (uint16_t) product);
+    }
+}
 
+bool System::backlogged(const OrderData &order) const {
+    for (auto product: order.products) {
+        if (machines_data[(unsigned int) product]->backlog.load(
+                std::memory_order_relaxed) > 1)
+            return true;
+    }
+
+    return false;
+}
+
+bool System::fetched(const FetchCompletion &completion) {
+    std::unique_lock<std::mutex> lock(completion.mut);
+    return completion.done();
+}
+
+void System::finish(unsigned int worker, std::shared_ptr<OrderData> order) {
+    auto &counters = worker_stats[worker];
+    auto &completion = order->fetch;
+    auto &products = order->products;
+
+    std::unique_lock<std::mutex> lock3(completion.mut);
+    completion.cv.wait(lock3, [&completion] { return completion.done(); });
+    auto collecting = std::move(completion.collected);
+    auto failed = std::move(completion.failed);
+    lock3.unlock();
+
+    std::unique_lock<std::mutex> lock2(shardOf(order->id).mut);
+    if (order->status.load() == OrderStatus::CANCELLED) {
         lock2.unlock();
+        report(worker, ReportKind::CANCELLED, order->id, products);
+        returnProducts(collecting);
+        return;
+    }
 
-        switch (status) {
-            case OrderStatus::READY:
-                report.collectedOrders.push_back(products);
-                break;
-            case OrderStatus::FAILED:
-                report.failedOrders.push_back(products);
-                break;
-            case OrderStatus::EXPIRED:
-                report.abandonedOrders.push_back(products);
-                break;
-            default:
-                break;
+    OrderStatus status = (collecting.size() == products.size()) ? OrderStatus::READY : OrderStatus::FAILED;
+    order->ready = std::chrono::steady_clock::now();
+    if (status == OrderStatus::READY) {
+        order->completed = std::move(collecting);
+        order->worker = worker;
+    }
+    setStatus(*order, status);
+    tracer.record(status == OrderStatus::READY ? TraceEvent::READY : TraceEvent::FAILED,
+                  order->id);
+    counters.preparing.record(order->ready - order->started);
+    if (finished_orders.fetch_add(1, std::memory_order_relaxed) % finish_window == 0) {
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                order->ready.time_since_epoch()).count();
+        auto start = finish_window_start_ns.exchange(now, std::memory_order_relaxed);
+        if (start != 0 && now > start) smooth(finish_gap_ns, (now - start) / finish_window);
+    }
+    auto &priority = counters.classes[(unsigned int) order->priority];
+    priority.orders.fetch_add(1, std::memory_order_relaxed);
+    priority.latency.record(order->ready - order->submitted);
+    if (order->deadline != std::chrono::steady_clock::time_point::max()) {
+        priority.with_deadline.fetch_add(1, std::memory_order_relaxed);
+        if (order->ready > order->deadline)
+            priority.missed.fetch_add(1, std::memory_order_relaxed);
+    }
+    (status == OrderStatus::READY ? counters.ready : counters.failed).fetch_add(
+            1, std::memory_order_relaxed);
+    auto callback = std::move(order->callback);
+    lock2.unlock();
+
+    if (!failed.empty())
+        report(worker, ReportKind::FAILED_PRODUCTS, order->id, std::move(failed));
+    if (status == OrderStatus::FAILED)
+        report(worker, ReportKind::FAILED, order->id, products);
+
+    if (status == OrderStatus::FAILED) {
+        returnProducts(collecting);
+    }
+
+    if (callback) notifyCollector(order->id, &order->status, callback);
+
+    if (status == OrderStatus::FAILED) schedule(order->id, true);
+    else if (!callback) schedule(order->id, false);
+}
+
+void System::smooth(std::atomic<uint64_t> &average, uint64_t sample) {
+    auto old = average.load(std::memory_order_relaxed);
+    average.store(old == 0 ? sample : old - old / 8 + sample / 8,
+                  std::memory_order_relaxed);
+}
+
+bool System::admit(std::span<const std::vector<ProductId>> orders, Priority priority,
+                   std::chrono::steady_clock::duration deadline) const {
+    auto max_pending = admission_max_pending.load(std::memory_order_relaxed);
+    auto estimate = admission_estimate.load(std::memory_order_relaxed);
+    if (max_pending == 0 && !estimate) return true;
+
+    size_t pending = 0, ahead = 0;
+    for (unsigned int i = 0; i < priorities; i++) {
+        auto size = lanes[i].size();
+        pending += size;
+        if (i <= (unsigned int) priority) ahead += size;
+    }
+
+    if (max_pending != 0 && pending + orders.size() > max_pending) return false;
+    if (!estimate) return true;
+
+    auto waiting = (ahead + orders.size()) * finish_gap_ns.load(std::memory_order_relaxed);
+    auto budget = deadline > std::chrono::steady_clock::duration::zero()
+                  ? deadline : std::chrono::milliseconds(clientTimeout);
+    for (auto &products: orders) {
+        uint64_t fetching = 0;
+        for (auto product: products) {
+            auto &data = *machines_data[(unsigned int) product];
+            fetching = std::max<uint64_t>(
+                    fetching, (data.backlog.load(std::memory_order_relaxed) + 1) *
+                              data.item_ns.load(std::memory_order_relaxed));
         }
+        if (std::chrono::nanoseconds(waiting + fetching) > budget) return false;
+    }
 
-        if (status == OrderStatus::FAILED || status == OrderStatus::EXPIRED) {
-            std::unique_lock<std::mutex> lock3(machines_mutex);
-            for (auto &pair: collecting) {
-                machines[pair.first]->returnProduct(std::move(pair.second));
+    return true;
+}
+
+void System::setAdmission(size_t maxPending, bool byEstimate) {
+    admission_max_pending.store(maxPending);
+    admission_estimate.store(byEstimate);
+}
+
+void System::setProbeInterval(std::chrono::steady_clock::duration interval) {
+    probe_interval.store(interval.count());
+    for (auto &data: machines_data) {
+        std::unique_lock<std::mutex> lock(data->mut);
+        data->cv.notify_all();
+        lock.unlock();
+    }
+}
+
+void System::setPrefetch(size_t limit, std::chrono::steady_clock::duration window) {
+    prefetch_window.store(window.count());
+    prefetch_limit.store(limit);
+    for (auto &data: machines_data) {
+        std::unique_lock<std::mutex> lock(data->mut);
+        data->cv.notify_all();
+        lock.unlock();
+    }
+}
+
+void System::startTrace(const std::string &path) {
+    tracer.open(path, product_names, numberOfWorkers, clientTimeout);
+}
+
+void System::stopTrace() {
+    tracer.close();
+}
+
+void System::setScaling(std::chrono::steady_clock::duration growAfter,
+                        std::chrono::steady_clock::duration idleAfter) {
+    grow_after.store(growAfter.count());
+    idle_after.store(idleAfter.count());
+}
+
+// A retiring worker takes nothing more; what is left in its ring is stolen
+// by the others. Every aging_interval-th take starts at the next lane and
+// ring in rotation instead of the highest priority and the worker's own
+// ring, so each ring of each lane gets first pick at least once every
+// priorities * rings * aging_interval takes of a busy worker.
+bool System::take(unsigned int worker, std::shared_ptr<OrderData> &order, bool wait) {
+    auto &slot = workers[worker];
+    auto round = slot.takes++;
+    size_t first_lane = 0, first_ring = worker;
+    if (round % aging_interval == aging_interval - 1) {
+        auto aged = round / aging_interval;
+        first_lane = aged % priorities;
+        first_ring = worker + aged / priorities;
+    }
+
+    while (true) {
+        if (slot.retiring.load()) return false;
+        auto epoch = work_available.epoch.load();
+        for (size_t l = 0; l < priorities; l++) {
+            auto &lane = lanes[(first_lane + l) % priorities];
+            auto count = lane.rings.size();
+            for (size_t i = 0; i < count; i++) {
+                if (lane.rings[(first_ring + i) % count]->tryPop(order)) return true;
             }
-            lock3.unlock();
         }
+        if (!wait || lanes_closed.load()) return false;
+        work_available.wait(epoch);
     }
+}
 
-    std::unique_lock<std::mutex> lock(reports_mutex);
-    reports.push_back(std::move(report));
-    lock.unlock();
+// Machine requests are queued first, see dispatch(). Then each submitting
+// thread deals its orders round-robin over the rings of the active workers,
+// starting at a different ring than the previous thread to submit to this
+// System. A full ring is passed over while another one has room.
+void System::submit(std::shared_ptr<OrderData> *orders, size_t count) {
+    thread_local struct {
+        const System *system = nullptr;
+        size_t next = 0;
+    } ring;
+    if (ring.system != this) ring = {this, submit_clients.fetch_add(1, std::memory_order_relaxed)};
+
+    for (size_t i = 0; i < count; i++) {
+        std::shared_ptr<FetchCompletion> completion(orders[i], &orders[i]->fetch);
+        completion->remaining = orders[i]->products.size();
+        dispatch(*orders[i], std::move(completion));
+    }
+
+    for (size_t i = 0; i < count;) {
+        auto priority = orders[i]->priority;
+        size_t run = 1;
+        while (i + run < count && orders[i + run]->priority == priority) run++;
+
+        auto &rings = lanes[(unsigned int) priority].rings;
+        auto home = ring.next++ % std::max(active_workers.load(std::memory_order_relaxed), 1u);
+        bool pushed = false;
+        for (size_t k = 0; k < rings.size() && !pushed; k++) {
+            pushed = rings[(home + k) % rings.size()]->tryPush(orders + i, run);
+        }
+        if (!pushed) rings[home]->push(orders + i, run);
+        i += run;
+    }
+
+    work_available.notify(count);
+}
+
+// Machine requests are queued when an order is submitted, so deferring only
+// changes which finished order a worker hands out first.
+void System::run(unsigned int worker) {
+    std::shared_ptr<OrderData> order;
+    std::deque<DeferredOrder> deferred;
+    auto &counters = worker_stats[worker];
+    auto &slot = workers[worker];
+    auto idle_since = std::chrono::steady_clock::now();
+
+    while (true) {
+        for (auto entry = deferred.begin(); entry != deferred.end();) {
+            if (entry->passed < dispatchFairness && !fetched(entry->order->fetch)) {
+                entry++;
+                continue;
+            }
+            finish(worker, std::move(entry->order));
+            entry = deferred.erase(entry);
+        }
+
+        if (deferred.empty()) {
+            auto busy_since = std::chrono::steady_clock::now();
+            counters.busy_ns.fetch_add(std::chrono::nanoseconds(busy_since - idle_since).count(),
+                                       std::memory_order_relaxed);
+            slot.idle_since.store(busy_since.time_since_epoch().count());
+            if (!take(worker, order, true)) {
+                idle_since = busy_since;
+                break;
+            }
+            slot.idle_since.store(0);
+            idle_since = std::chrono::steady_clock::now();
+            counters.idle_ns.fetch_add(std::chrono::nanoseconds(idle_since - busy_since).count(),
+                                       std::memory_order_relaxed);
+        } else if (!take(worker, order, false)) {
+            finish(worker, std::move(deferred.front().order));
+            deferred.pop_front();
+            continue;
+        }
+
+        order->started = std::chrono::steady_clock::now();
+        auto queued = std::chrono::nanoseconds(order->started - order->submitted).count();
+        counters.queued.record((uint64_t) std::max<int64_t>(0, queued));
+        counters.taken.fetch_add(1, std::memory_order_relaxed);
+        counters.queued_ns.fetch_add(std::max<int64_t>(0, queued), std::memory_order_relaxed);
+
+        if (deferred.size() < dispatchFairness && backlogged(*order)) {
+            deferred.push_back({std::move(order), 0});
+            continue;
+        }
+
+        finish(worker, std::move(order));
+        for (auto &entry: deferred) {
+            entry.passed++;
+        }
+    }
+
+    counters.idle_ns.fetch_add(std::chrono::nanoseconds(
+            std::chrono::steady_clock::now() - idle_since).count(),
+                               std::memory_order_relaxed);
+    // Pass on a wake-up this worker may have taken from the others.
+    if (slot.retiring.load()) work_available.notifyOne();
+    slot.exited.store(true);
+}
+
+void System::startWorker(unsigned int worker) {
+    if (workers[worker].thread.joinable()) reapWorker(worker);
+    if (used_workers.load() <= worker) used_workers.store(worker + 1);
+    workers[worker].thread = std::thread([this, worker] { run(worker); });
+    active_workers.store(worker + 1);
+}
+
+// Does not wait: the worker finishes the orders it holds and exits, and is
+// reaped by a later scaler tick.
+void System::retireWorker(unsigned int worker) {
+    auto &slot = workers[worker];
+    active_workers.store(worker);
+    slot.retiring.store(true);
+    work_available.notifyAll();
+}
+
+void System::reapWorker(unsigned int worker) {
+    auto &slot = workers[worker];
+    slot.thread.join();
+    slot.retiring.store(false);
+    slot.exited.store(false);
+    slot.idle_since.store(0);
+}
+
+// Orders count as waiting too long when their average time in the lanes
+// exceeded grow_after over the last tick, or when none was taken while some
+// are queued. Workers are only added or retired at the top of the pool.
+void System::scale() {
+    uint64_t taken = 0, queued_ns = 0;
+    std::unique_lock<std::mutex> lock(scaler_mutex);
+    while (!scaler_cv.wait_for(lock, scale_tick, [this] { return scaler_closing; })) {
+        lock.unlock();
+
+        for (auto i = active_workers.load(); i < used_workers.load(); i++) {
+            if (workers[i].exited.load() && workers[i].thread.joinable()) reapWorker(i);
+        }
+
+        uint64_t now_taken = 0, now_queued_ns = 0;
+        for (unsigned int i = 0; i < used_workers.load(); i++) {
+            now_taken += worker_stats[i].taken.load(std::memory_order_relaxed);
+            now_queued_ns += worker_stats[i].queued_ns.load(std::memory_order_relaxed);
+        }
+        auto recent = now_taken - taken;
+        auto recent_ns = now_queued_ns - queued_ns;
+        taken = now_taken;
+        queued_ns = now_queued_ns;
+
+        size_t pending = 0;
+        for (auto &lane: lanes) {
+            pending += lane.size();
+        }
+        auto limit = std::chrono::nanoseconds(
+                std::chrono::steady_clock::duration(grow_after.load())).count();
+        bool waiting = pending > 0 && (recent == 0 || recent_ns / recent > (uint64_t) limit);
+
+        auto active = active_workers.load();
+        if (waiting && active < maxWorkers) {
+            startWorker(active);
+        } else if (!waiting && active > numberOfWorkers) {
+            auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            for (unsigned int i = 0; i < active; i++) {
+                auto since = workers[i].idle_since.load();
+                if (since != 0 && now - since >= idle_after.load()) {
+                    retireWorker(active - 1);
+                    break;
+                }
+            }
+        }
+
+        lock.lock();
+    }
 }
 
 System::System(machines_t machines, unsigned int numberOfWorkers,
-               unsigned int clientTimeout) :
+               unsigned int clientTimeout, unsigned int dispatchFairness,
+               unsigned int maxWorkers) :
+        System(std::move(machines), {}, numberOfWorkers, clientTimeout, dispatchFairness,
+               maxWorkers) {}
+
+System::System(machines_t machines, access_t access, unsigned int numberOfWorkers,
+               unsigned int clientTimeout, unsigned int dispatchFairness,
+               unsigned int maxWorkers) :
         is_open(true),
-        machines(std::move(machines)),
         numberOfWorkers(numberOfWorkers),
-        clientTimeout(clientTimeout) {
-    for (const auto &machine: this->machines) {
-        menu.insert(machine.first);
-        machines_data.insert(
-                std::make_pair(machine.first, std::make_shared<MachineData>()));
-        machine.second->start();
+        clientTimeout(clientTimeout),
+        dispatchFairness(dispatchFairness),
+        menu(new std::atomic<bool>[machines.size()]),
+        maxWorkers(std::max(maxWorkers, numberOfWorkers)),
+        workers(new WorkerSlot[this->maxWorkers]) {
+    for (const auto &machine: machines) {
+        product_names.push_back(machine.first);
+    }
+    std::sort(product_names.begin(), product_names.end());
+
+    for (unsigned int i = 0; i < product_names.size(); i++) {
+        product_ids.emplace(product_names[i], ProductId(i));
+        this->machines.push_back(machines[product_names[i]]);
+        auto hooks = access.find(product_names[i]);
+        this->access.push_back(hooks != access.end() ? hooks->second
+                                                     : MachineAccess::virtualCalls());
+        machines_data.push_back(std::make_unique<MachineData>());
+        menu[i].store(true);
+        this->machines[i]->start();
+    }
+
+    for (unsigned int i = 0; i < machines_data.size(); i++) {
+        machines_data[i]->fetcher = std::thread([this, i] {
+            fetch(ProductId(i), *machines_data[i]);
+        });
     }
 
+    auto rings = std::max(this->maxWorkers, 1u);
+    auto ring_capacity = std::max<size_t>(std::bit_ceil(pending_orders_capacity / rings), 1024);
+    for (auto &lane: lanes) {
+        for (unsigned int i = 0; i < rings; i++) {
+            lane.rings.push_back(std::make_unique<MPMCQueue<std::shared_ptr<OrderData>>>(
+                    ring_capacity));
+        }
+    }
+
+    report_logs.reset(new ReportLog[this->maxWorkers]);
+    worker_stats.reset(new WorkerCounters[this->maxWorkers]);
+    expirer = std::thread([this] { expire(); });
+
     for (unsigned int i = 0; i < numberOfWorkers; i++) {
-        workers.emplace_back([this] { run(); });
+        startWorker(i);
+    }
+    if (this->maxWorkers > numberOfWorkers) {
+        scaler = std::thread([this] { scale(); });
     }
 }
 
 std::vector<WorkerReport> System::shutdown() {
-    if (!is_open) return {};
-    reports.clear();
+    if (!is_open.exchange(false)) return {};
 
-    std::unique_lock<std::mutex> lock(pending_orders_mutex);
-    is_open = false;
-    pending_orders.push_back(-1);
-    pending_orders_cv.notify_all();
-    lock.unlock();
-    for (auto &worker: workers) {
-        worker.join();
+    for (auto count = submitters.load(); count != 0; count = submitters.load())
+        submitters.wait(count);
+
+    if (scaler.joinable()) {
+        std::unique_lock<std::mutex> lock(scaler_mutex);
+        scaler_closing = true;
+        scaler_cv.notify_all();
+        lock.unlock();
+        scaler.join();
+    }
+
+    lanes_closed.store(true);
+    work_available.notifyAll();
+    for (unsigned int i = 0; i < used_workers.load(); i++) {
+        if (workers[i].thread.joinable()) workers[i].thread.join();
+    }
+
+    std::unique_lock<std::mutex> lock2(deadlines_mutex);
+    deadlines_closing = true;
+    deadlines_cv.notify_all();
+    lock2.unlock();
+    expirer.join();
+
+    for (auto &data: machines_data) {
+        std::unique_lock<std::mutex> lock2(data->mut);
+        data->closing = true;
+        data->cv.notify_all();
+        lock2.unlock();
+        data->fetcher.join();
     }
 
-    for (auto &machine: machines) {
-        machine.second->stop();
+    for (unsigned int i = 0; i < machines.size(); i++) {
+        machines[i]->stop();
+        menu[i].store(false);
+    }
+    tracer.close();
+
+    std::vector<WorkerReport> reports(used_workers.load());
+    auto remaining = drainReports();
+    for (auto &record: remaining.records) {
+        auto ids = remaining.productsOf(record);
+        auto &into = reports[record.worker];
+        if (record.kind == ReportKind::FAILED_PRODUCTS) {
+            for (auto product: ids) {
+                into.failedProducts.push_back(product_names[(unsigned int) product]);
+            }
+            continue;
+        }
+
+        auto names = productNames({ids.begin(), ids.end()});
+        switch (record.kind) {
+            case ReportKind::COLLECTED:
+                into.collectedOrders.push_back(std::move(names));
+                break;
+            case ReportKind::ABANDONED:
+                into.abandonedOrders.push_back(std::move(names));
+                break;
+            case ReportKind::FAILED:
+                into.failedOrders.push_back(std::move(names));
+                break;
+            default:
+                break;
+        }
     }
 
-    menu.clear();
+    return reports;
+}
 
-    return std::move(reports);
+void System::report(unsigned int worker, ReportKind kind, unsigned int order,
+                    std::vector<ProductId> products) {
+    auto &log = report_logs[worker];
+    ReportEntry entry{kind, order, std::move(products)};
+    while (!log.ring.tryPush(entry)) {
+        std::unique_lock<std::mutex> lock(log.mut);
+        drainLog(worker, log.retained);
+        lock.unlock();
+    }
+}
+
+void System::drainLog(unsigned int worker, CompactReport &into) {
+    ReportEntry entry;
+    while (report_logs[worker].ring.tryPop(entry)) {
+        into.append(entry.kind, worker, entry.order, entry.products);
+    }
+}
+
+CompactReport System::drainReports() {
+    CompactReport result;
+    for (unsigned int i = 0; i < used_workers.load(); i++) {
+        auto &log = report_logs[i];
+        std::unique_lock<std::mutex> lock(log.mut);
+        auto offset = result.products.size();
+        for (auto record: log.retained.records) {
+            record.first += offset;
+            result.records.push_back(record);
+        }
+        result.products.insert(result.products.end(), log.retained.products.begin(),
+                               log.retained.products.end());
+        log.retained = CompactReport();
+        drainLog(i, result);
+        lock.unlock();
+    }
+
+    return result;
 }
 
 std::vector<std::string> System::getMenu() const {
     std::vector<std::string> result;
-    std::unique_lock<std::mutex> lock(menu_mutex);
-    for (auto &product: menu) {
-        result.emplace_back(product);
+    for (unsigned int i = 0; i < product_names.size(); i++) {
+        if (menu[i].load()) result.emplace_back(product_names[i]);
     }
-    lock.unlock();
 
     return result;
 }
 
 std::vector<unsigned int> System::getPendingOrders() const {
     std::vector<unsigned int> result;
-    std::unique_lock<std::mutex> lock(pending_orders_mutex);
-    for (auto order: orders_in_progress) {
-        result.emplace_back(order);
+    for (auto &shard: orders_data) {
+        std::unique_lock<std::mutex> lock(shard.mut);
+        for (auto &[id, order]: shard.orders) {
+            if (order->status.load() == OrderStatus::IN_PROGRES)
+                result.emplace_back(id);
+        }
+        lock.unlock();
+    }
+    std::sort(result.begin(), result.end());
+
+    return result;
+}
+
+SystemStats System::stats() const {
+    SystemStats result;
+
+    for (unsigned int i = 0; i < machines_data.size(); i++) {
+        auto &data = *machines_data[i];
+        MachineStats machine;
+        machine.product = product_names[i];
+        machine.on_menu = menu[i].load();
+        std::unique_lock<std::mutex> lock(data.mut);
+        machine.queue_depth = data.waiting.size();
+        lock.unlock();
+        machine.fetched = data.fetched.load(std::memory_order_relaxed);
+        machine.failed = data.failed.load(std::memory_order_relaxed);
+        machine.health = data.health.load();
+        machine.fast_failed = data.fast_failed.load(std::memory_order_relaxed);
+        machine.probes = data.probes.load(std::memory_order_relaxed);
+        machine.returned = data.returned.load(std::memory_order_relaxed);
+        machine.prefetched = data.prefetched.load(std::memory_order_relaxed);
+        machine.served_from_stock = data.served_from_stock.load(std::memory_order_relaxed);
+        machine.stock = data.stocked.load(std::memory_order_relaxed);
+        machine.fetch_latency.add(data.fetch_latency);
+        result.machines.push_back(std::move(machine));
+    }
+
+    result.priorities.resize(priorities);
+    result.trace_dropped = tracer.droppedRecords();
+    result.active_workers = active_workers.load();
+    for (unsigned int i = 0; i < used_workers.load(); i++) {
+        auto &counters = worker_stats[i];
+        for (unsigned int p = 0; p < priorities; p++) {
+            auto &from = counters.classes[p];
+            auto &into = result.priorities[p];
+            into.orders += from.orders.load(std::memory_order_relaxed);
+            into.with_deadline += from.with_deadline.load(std::memory_order_relaxed);
+            into.missed += from.missed.load(std::memory_order_relaxed);
+            into.latency.add(from.latency);
+        }
+        WorkerStats worker;
+        worker.active = i < result.active_workers;
+        worker.orders = counters.ready.load(std::memory_order_relaxed) +
+                        counters.failed.load(std::memory_order_relaxed);
+        worker.busy = std::chrono::nanoseconds(counters.busy_ns.load(std::memory_order_relaxed));
+        worker.idle = std::chrono::nanoseconds(counters.idle_ns.load(std::memory_order_relaxed));
+        result.workers.push_back(worker);
+        result.ready_orders += counters.ready.load(std::memory_order_relaxed);
+        result.failed_orders += counters.failed.load(std::memory_order_relaxed);
+        result.queued.add(counters.queued);
+        result.preparing.add(counters.preparing);
+    }
+
+    order_stats.forEach([&result](const OrderCounters &counters) {
+        result.collected_orders += counters.collected.load(std::memory_order_relaxed);
+        result.expired_orders += counters.expired.load(std::memory_order_relaxed);
+        result.rejected_orders += counters.rejected.load(std::memory_order_relaxed);
+        result.cancelled_orders += counters.cancelled.load(std::memory_order_relaxed);
+        result.collected.add(counters.collected_after);
+        result.expired.add(counters.expired_after);
+    });
+
+    for (auto &lane: lanes) {
+        result.pending_orders += lane.size();
+    }
+    for (auto &shard: orders_data) {
+        std::unique_lock<std::mutex> lock(shard.mut);
+        result.registered_orders += shard.orders.size();
+        lock.unlock();
     }
-    lock.unlock();
 
     return result;
 }
@@ -229,57 +1126,278 @@ unsigned int System::getClientTimeout() const {
     return clientTimeout;
 }
 
-std::unique_ptr<CoasterPager> System::order(std::vector<std::string> products) {
-    std::unique_lock<std::mutex> lock(pending_orders_mutex);
+void System::leaveSubmission() {
+    if (submitters.fetch_sub(1) == 1 && !is_open) submitters.notify_all();
+}
+
+const std::string &System::getProductName(ProductId product) const {
+    if ((unsigned int) product >= product_names.size()) throw BadOrderException();
+
+    return product_names[(unsigned int) product];
+}
+
+ProductId System::getProductId(const std::string &product) const {
+    auto id = product_ids.find(product);
+    if (id == product_ids.end()) throw BadOrderException();
+
+    return id->second;
+}
+
+std::unique_ptr<CoasterPager>
+System::order(std::vector<std::string> products, Priority priority,
+              std::chrono::steady_clock::duration deadline) {
     if (!is_open) throw RestaurantClosedException();
-    lock.unlock();
 
-    std::unique_lock<std::mutex> lock2(menu_mutex);
-    bool proper_order = std::all_of(products.begin(), products.end(),
-                                    [this](const std::string &product) {
-                                        return menu.find(product) != menu.end();
-                                    });
-    lock2.unlock();
+    std::vector<ProductId> ids;
+    ids.reserve(products.size());
+    for (auto &product: products) {
+        ids.push_back(getProductId(product));
+    }
 
-    if (!proper_order) throw BadOrderException();
+    return order(std::move(ids), priority, deadline);
+}
 
-    std::unique_lock<std::mutex> lock3(orders_mutex);
+std::unique_ptr<CoasterPager>
+System::tryOrder(std::vector<std::string> products, Priority priority,
+                 std::chrono::steady_clock::duration deadline) {
+    if (!is_open) throw RestaurantClosedException();
 
-    auto order_pager = std::make_unique<CoasterPager>();
-    auto order = std::make_shared<OrderData>();
+    std::vector<ProductId> ids;
+    ids.reserve(products.size());
+    for (auto &product: products) {
+        ids.push_back(getProductId(product));
+    }
 
-    order_pager->id = current_order_id++;
-    order->status = order_pager->status;
-    order->pager_cv = order_pager->cv;
+    return tryOrder(std::move(ids), priority, deadline);
+}
 
-    orders_data.insert(std::make_pair(order_pager->id, order));
-    orders_products.insert(
-            std::make_pair(order_pager->id, std::move(products)));
+std::unique_ptr<CoasterPager>
+System::order(std::initializer_list<std::string> products, Priority priority,
+              std::chrono::steady_clock::duration deadline) {
+    return order(std::vector<std::string>(products), priority, deadline);
+}
 
-    lock3.unlock();
+bool System::onMenu(const std::vector<ProductId> &products) const {
+    return std::all_of(products.begin(), products.end(),
+                       [this](ProductId product) {
+                           return (unsigned int) product < product_names.size() &&
+                                  menu[(unsigned int) product].load();
+                       });
+}
 
-    lock.lock();
+std::shared_ptr<System::OrderData>
+System::registerOrder(unsigned int id, std::vector<ProductId> products,
+                      Priority priority, std::chrono::steady_clock::duration deadline,
+                      CoasterPager &pager) {
+    auto order = std::allocate_shared<OrderData>(PoolAllocator<OrderData>());
 
-    pending_orders.push_back(order_pager->id);
-    pending_orders_cv.notify_all();
-    orders_in_progress.insert(order_pager->id);
+    order->id = id;
+    order->products = std::move(products);
+    order->priority = priority;
+    order->submitted = std::chrono::steady_clock::now();
+    order->deadline = deadline > std::chrono::steady_clock::duration::zero()
+                      ? order->submitted + deadline
+                      : std::chrono::steady_clock::time_point::max();
+    pager.id = id;
+    pager.status = std::shared_ptr<std::atomic<OrderStatus>>(
+            order, &order->status);
+    pager.awaited = &order->awaited;
 
+    auto &shard = shardOf(id);
+    std::unique_lock<std::mutex> lock(shard.mut);
+    shard.orders.insert_or_assign(id, order);
     lock.unlock();
 
+    tracer.record(TraceEvent::SUBMITTED, id, 0,
+                  (uint64_t) std::chrono::nanoseconds(deadline).count(), (uint8_t) priority);
+    for (auto product: order->products) {
+        tracer.record(TraceEvent::ITEM, id, (uint16_t) product);
+    }
+
+    return order;
+}
+
+std::unique_ptr<CoasterPager>
+System::order(std::vector<ProductId> products, Priority priority,
+              std::chrono::steady_clock::duration deadline) {
+    auto pager = tryOrder(std::move(products), priority, deadline);
+    if (pager == nullptr) throw SystemOverloadedException();
+
+    return pager;
+}
+
+std::unique_ptr<CoasterPager>
+System::tryOrder(std::vector<ProductId> products, Priority priority,
+                 std::chrono::steady_clock::duration deadline) {
+    submitters.fetch_add(1);
+    if (!is_open) {
+        leaveSubmission();
+        throw RestaurantClosedException();
+    }
+
+    if (!onMenu(products)) {
+        leaveSubmission();
+        throw BadOrderException();
+    }
+
+    if (!admit({&products, 1}, priority, deadline)) {
+        leaveSubmission();
+        order_stats.local().rejected.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    auto order_pager = std::make_unique<CoasterPager>();
+    auto order = registerOrder(current_order_id.fetch_add(1), std::move(products),
+                               priority, deadline, *order_pager);
+
+    submit(&order, 1);
+    leaveSubmission();
+
     return order_pager;
 }
 
+std::vector<std::unique_ptr<CoasterPager>>
+System::orderBatch(std::vector<std::vector<std::string>> orders, Priority priority,
+                   std::chrono::steady_clock::duration deadline) {
+    if (!is_open) throw RestaurantClosedException();
+
+    std::vector<std::vector<ProductId>> resolved(orders.size());
+    for (size_t i = 0; i < orders.size(); i++) {
+        resolved[i].reserve(orders[i].size());
+        for (auto &product: orders[i]) {
+            resolved[i].push_back(getProductId(product));
+        }
+    }
+
+    submitters.fetch_add(1);
+    if (!is_open) {
+        leaveSubmission();
+        throw RestaurantClosedException();
+    }
+
+    if (!std::all_of(resolved.begin(), resolved.end(),
+                     [this](const std::vector<ProductId> &products) {
+                         return onMenu(products);
+                     })) {
+        leaveSubmission();
+        throw BadOrderException();
+    }
+
+    if (!admit(resolved, priority, deadline)) {
+        leaveSubmission();
+        order_stats.local().rejected.fetch_add(resolved.size(), std::memory_order_relaxed);
+        throw SystemOverloadedException();
+    }
+
+    auto first = current_order_id.fetch_add(resolved.size());
+    std::vector<std::unique_ptr<CoasterPager>> pagers;
+    std::vector<std::shared_ptr<OrderData>> batch;
+    pagers.reserve(resolved.size());
+    batch.reserve(resolved.size());
+    for (size_t i = 0; i < resolved.size(); i++) {
+        pagers.push_back(std::make_unique<CoasterPager>());
+        batch.push_back(registerOrder(first + i, std::move(resolved[i]),
+                                      priority, deadline, *pagers.back()));
+    }
+
+    submit(batch.data(), batch.size());
+    leaveSubmission();
+
+    return pagers;
+}
+
 std::vector<std::unique_ptr<Product>>
 System::collectOrder(std::unique_ptr<CoasterPager> CoasterPager) {
     if (CoasterPager == nullptr) throw BadPagerException();
+
+    return collect(CoasterPager->id, CoasterPager->status.get());
+}
+
+void System::cancelOrder(std::unique_ptr<CoasterPager> CoasterPager) {
+    if (CoasterPager == nullptr) throw BadPagerException();
+
     auto id = CoasterPager->id;
+    auto &shard = shardOf(id);
+    std::unique_lock<std::mutex> lock(shard.mut);
+    auto entry = shard.orders.find(id);
+    if (entry == shard.orders.end() ||
+        &entry->second->status != CoasterPager->status.get()) {
+        lock.unlock();
+        auto status = CoasterPager->status != nullptr ? CoasterPager->status->load()
+                                                      : OrderStatus::IN_PROGRES;
+        if (status != OrderStatus::FAILED && status != OrderStatus::EXPIRED)
+            throw BadPagerException();
+        return;
+    }
+
+    auto order = entry->second;
+    auto status = order->status.load();
+    if (status != OrderStatus::READY && status != OrderStatus::IN_PROGRES) {
+        lock.unlock();
+        return;
+    }
+
+    shard.orders.erase(entry);
+    setStatus(*order, OrderStatus::CANCELLED);
+    tracer.record(TraceEvent::CANCELLED, id);
+    order_stats.local().cancelled.fetch_add(1, std::memory_order_relaxed);
+    auto collecting = std::move(order->completed);
+    auto products = order->products;
+    lock.unlock();
+
+    if (status == OrderStatus::READY) {
+        report(order->worker, ReportKind::CANCELLED, id, std::move(products));
+        returnProducts(collecting);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock2(order->fetch.mut);
+    order->fetch.aborted = true;
+    collecting = std::move(order->fetch.collected);
+    order->fetch.cv.notify_one();
+    lock2.unlock();
+
+    std::sort(products.begin(), products.end());
+    products.erase(std::unique(products.begin(), products.end()), products.end());
+    for (auto product: products) {
+        withdraw(product, order->fetch);
+    }
+
+    returnProducts(collecting);
+}
+
+System::order_map_t::iterator
+System::findOrder(OrderShard &shard, unsigned int id,
+                  const std::atomic<OrderStatus> *status) {
+    auto order = shard.orders.find(id);
+    if (order != shard.orders.end() && &order->second->status == status)
+        return order;
+
+    switch (status != nullptr ? status->load() : OrderStatus::IN_PROGRES) {
+        case EXPIRED:
+            throw OrderExpiredException();
+        case FAILED:
+            throw FulfillmentFailure();
+        default:
+            throw BadPagerException();
+    }
+}
+
+void System::recordCollected(const OrderData &order) {
+    auto &counters = order_stats.local();
+    counters.collected.fetch_add(1, std::memory_order_relaxed);
+    counters.collected_after.record(std::chrono::steady_clock::now() - order.ready);
+    tracer.record(TraceEvent::COLLECTED, order.id);
+}
 
-    std::unique_lock<std::mutex> lock(orders_mutex);
+std::vector<std::unique_ptr<Product>>
+System::collect(unsigned int id, const std::atomic<OrderStatus> *status) {
+    auto &shard = shardOf(id);
+    std::unique_lock<std::mutex> lock(shard.mut);
 
-    auto order = orders_data.find(id);
-    if (order == orders_data.end()) throw BadPagerException();
+    auto order = findOrder(shard, id, status);
 
-    switch (*order->second->status) {
+    switch (order->second->status.load()) {
         case READY:
             break;
         case IN_PROGRES:
@@ -288,15 +1406,149 @@ System::collectOrder(std::unique_ptr<CoasterPager> CoasterPager) {
             throw FulfillmentFailure();
         case EXPIRED:
             throw OrderExpiredException();
+        case CANCELLED:
+            throw BadPagerException();
     }
 
-    orders_data[id]->client_collecting = true;
-    orders_data[id]->cv.notify_all();
+    recordCollected(*order->second);
+    auto collecting = std::move(order->second->completed);
+    auto products = std::move(order->second->products);
+    auto worker = order->second->worker;
+    shard.orders.erase(order);
+    lock.unlock();
+
+    report(worker, ReportKind::COLLECTED, id, std::move(products));
 
-    orders_data[id]->collect_cv.wait(lock, [id, this]{ return orders_data[id]->ready_to_collect; });
+    std::vector<std::unique_ptr<Product>> result;
+    for (auto &pair: collecting) {
+        result.push_back(std::move(pair.second));
+    }
+
+    return result;
+}
+
+std::vector<std::vector<std::unique_ptr<Product>>>
+System::collectOrders(std::vector<std::unique_ptr<CoasterPager>> &CoasterPagers) {
+    std::vector<std::vector<std::unique_ptr<Product>>> result(CoasterPagers.size());
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < CoasterPagers.size(); i++) {
+        if (CoasterPagers[i] != nullptr) indices.push_back(i);
+    }
+    std::sort(indices.begin(), indices.end(), [&CoasterPagers](size_t a, size_t b) {
+        return CoasterPagers[a]->id % order_shards < CoasterPagers[b]->id % order_shards;
+    });
+
+    std::vector<std::tuple<unsigned int, unsigned int, std::vector<ProductId>>> collected;
+    for (size_t i = 0; i < indices.size();) {
+        auto &shard = shardOf(CoasterPagers[indices[i]]->id);
+        std::unique_lock<std::mutex> lock(shard.mut);
+        for (; i < indices.size() &&
+               &shardOf(CoasterPagers[indices[i]]->id) == &shard; i++) {
+            auto &pager = CoasterPagers[indices[i]];
+            auto order = shard.orders.find(pager->id);
+            if (order == shard.orders.end() ||
+                &order->second->status != pager->status.get() ||
+                order->second->status.load() != OrderStatus::READY)
+                continue;
+
+            recordCollected(*order->second);
+            for (auto &pair: order->second->completed) {
+                result[indices[i]].push_back(std::move(pair.second));
+            }
+            collected.emplace_back(order->second->worker, pager->id,
+                                   std::move(order->second->products));
+            shard.orders.erase(order);
+            pager.reset();
+        }
+        lock.unlock();
+    }
 
-    auto result = std::move(orders_data[id]->completed);
-    orders_data.erase(id);
+    for (auto &[worker, id, products]: collected) {
+        report(worker, ReportKind::COLLECTED, id, std::move(products));
+    }
 
     return result;
-}
\ No newline at end of file
+}
+
+void System::notifyCollector(unsigned int id,
+                             const std::atomic<OrderStatus> *status,
+                             collect_callback_t &callback) {
+    std::vector<std::unique_ptr<Product>> products;
+    std::exception_ptr error;
+    try {
+        products = collect(id, status);
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    // Runs on a worker, which has nowhere to pass the exception on to.
+    try {
+        callback(std::move(products), error);
+    }
+    catch (...) {
+    }
+}
+
+void System::collectWhenReady(std::unique_ptr<CoasterPager> CoasterPager,
+                              collect_callback_t callback) {
+    if (CoasterPager == nullptr) throw BadPagerException();
+    auto id = CoasterPager->id;
+    auto status = CoasterPager->status.get();
+
+    auto &shard = shardOf(id);
+    std::unique_lock<std::mutex> lock(shard.mut);
+
+    auto order = findOrder(shard, id, status);
+
+    if (order->second->status.load() == OrderStatus::IN_PROGRES) {
+        order->second->callback = std::move(callback);
+        return;
+    }
+    lock.unlock();
+
+    notifyCollector(id, status, callback);
+}
+
+std::future<std::vector<std::unique_ptr<Product>>>
+System::collectFuture(std::unique_ptr<CoasterPager> CoasterPager) {
+    auto promise = std::make_shared<std::promise<std::vector<std::unique_ptr<Product>>>>();
+    auto future = promise->get_future();
+
+    collectWhenReady(std::move(CoasterPager),
+                     [promise](std::vector<std::unique_ptr<Product>> products,
+                               std::exception_ptr error) {
+                         if (error) promise->set_exception(error);
+                         else promise->set_value(std::move(products));
+                     });
+
+    return future;
+}
+
+CollectAwaiter System::collectAsync(std::unique_ptr<CoasterPager> CoasterPager) {
+    return {*this, std::move(CoasterPager)};
+}
+
+CollectAwaiter::CollectAwaiter(System &system,
+                               std::unique_ptr<CoasterPager> pager) :
+        system(system),
+        pager(std::move(pager)) {}
+
+bool CollectAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    this->handle = handle;
+    system.collectWhenReady(std::move(pager),
+                            [this](std::vector<std::unique_ptr<Product>> products,
+                                   std::exception_ptr error) {
+                                this->products = std::move(products);
+                                this->error = error;
+                                if (done.exchange(true)) this->handle.resume();
+                            });
+
+    return !done.exchange(true);
+}
+
+std::vector<std::unique_ptr<Product>> CollectAwaiter::await_resume() {
+    if (error) std::rethrow_exception(error);
+
+    return std::move(products);
+}
@@ -1,19 +1,28 @@
 #ifndef SYSTEM_HPP
 #define SYSTEM_HPP
 
+#include <array>
+#include <atomic>
 #include <exception>
 #include <mutex>
 #include <condition_variable>
+#include <deque>
+#include <coroutine>
+#include <chrono>
 #include <future>
 #include <functional>
 #include <queue>
+#include <tuple>
+#include <type_traits>
+#include <span>
 #include <vector>
 #include <unordered_map>
-#include <map>
-#include <list>
-#include <set>
 
 #include "machine.hpp"
+#include "mpmc_queue.hpp"
+#include "pool.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 class FulfillmentFailure : public std::exception {
 };
@@ -33,6 +42,9 @@ class OrderExpiredException : public std::exception {
 class RestaurantClosedException : public std::exception {
 };
 
+class SystemOverloadedException : public std::exception {
+};
+
 struct WorkerReport {
     std::vector<std::vector<std::string>> collectedOrders;
     std::vector<std::vector<std::string>> abandonedOrders;
@@ -40,24 +52,77 @@ struct WorkerReport {
     std::vector<std::string> failedProducts;
 };
 
+enum class ProductId : unsigned int {
+};
+
+// Classes are served in this order; within a class machines serve the
+// earliest deadline first and orders without a deadline go last. One take in
+// every System::aging_interval gives the classes a turn in rotation, and one
+// machine batch in as many starts with the oldest request, so that no order
+// waits behind more urgent ones for ever.
+enum class Priority : unsigned char {
+    HIGH,
+    NORMAL,
+    LOW
+};
+
+enum class ReportKind : unsigned char {
+    COLLECTED,
+    ABANDONED,
+    FAILED,
+    FAILED_PRODUCTS,
+    CANCELLED
+};
+
+struct ReportRecord {
+    ReportKind kind;
+    unsigned int worker;
+    unsigned int order;
+    unsigned int count;
+    size_t first;
+};
+
+// Report records whose product lists are packed into one shared array;
+// `first` and `count` of a record index into `products`.
+struct CompactReport {
+    std::vector<ReportRecord> records;
+    std::vector<ProductId> products;
+
+    std::span<const ProductId> productsOf(const ReportRecord &record) const {
+        return {products.data() + record.first, record.count};
+    }
+
+    void append(ReportKind kind, unsigned int worker, unsigned int order,
+                const std::vector<ProductId> &ids) {
+        records.push_back({kind, worker, order, (unsigned int) ids.size(),
+                           products.size()});
+        products.insert(products.end(), ids.begin(), ids.end());
+    }
+};
+
 enum OrderStatus {
     READY,
     IN_PROGRES,
     FAILED,
-    EXPIRED
+    EXPIRED,
+    CANCELLED
 };
 
 class CoasterPager {
 private:
     friend class System;
 
-    std::shared_ptr<OrderStatus> status{
-            std::make_shared<OrderStatus>(IN_PROGRES)};
+    std::shared_ptr<std::atomic<OrderStatus>> status;
+    // Lives in the same order as `status`, which keeps it alive.
+    std::atomic<bool> *awaited{};
     unsigned int id{};
-    mutable std::mutex mut;
-    mutable std::shared_ptr<std::condition_variable> cv{
-            std::make_shared<std::condition_variable>()};
+
+    void await(const std::chrono::steady_clock::time_point *deadline) const;
 public:
+    static void *operator new(size_t size);
+
+    static void operator delete(void *block, size_t size);
+
     void wait() const;
 
     void wait(unsigned int timeout) const;
@@ -67,12 +132,94 @@ public:
     [[nodiscard]] bool isReady() const;
 };
 
+// How the fetchers reach one machine. virtualCalls() goes through the
+// Machine interface; of<M>() calls M's own functions by qualified name, so a
+// cheap machine's code is inlined into the hook and only the hook itself is
+// an indirect call, once per batch.
+struct MachineAccess {
+    std::vector<std::unique_ptr<Product>> (*getProducts)(Machine &machine, size_t n);
+    void (*returnProducts)(Machine &machine, std::vector<std::unique_ptr<Product>> products);
+
+    static MachineAccess virtualCalls() {
+        return {[](Machine &machine, size_t n) { return machine.getProducts(n); },
+                [](Machine &machine, std::vector<std::unique_ptr<Product>> products) {
+                    machine.returnProducts(std::move(products));
+                }};
+    }
+
+    // Machines that keep Machine's batch defaults get them rebuilt here on
+    // top of M's single-item functions.
+    template<typename M>
+    static MachineAccess of() {
+        static_assert(std::is_base_of_v<Machine, M>);
+        return {[](Machine &machine, size_t n) {
+                    auto &concrete = static_cast<M &>(machine);
+                    if constexpr (!std::is_same_v<decltype(&M::getProducts),
+                            decltype(&Machine::getProducts)>) {
+                        return concrete.M::getProducts(n);
+                    } else {
+                        std::vector<std::unique_ptr<Product>> products;
+                        if (n > 0) products.push_back(concrete.M::getProduct());
+                        return products;
+                    }
+                },
+                [](Machine &machine, std::vector<std::unique_ptr<Product>> products) {
+                    auto &concrete = static_cast<M &>(machine);
+                    if constexpr (!std::is_same_v<decltype(&M::returnProducts),
+                            decltype(&Machine::returnProducts)>) {
+                        concrete.M::returnProducts(std::move(products));
+                    } else {
+                        for (auto &product: products) {
+                            concrete.M::returnProduct(std::move(product));
+                        }
+                    }
+                }};
+    }
+};
+
+class System;
+
+class CollectAwaiter {
+public:
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle);
+
+    std::vector<std::unique_ptr<Product>> await_resume();
+
+private:
+    friend class System;
+
+    CollectAwaiter(System &system, std::unique_ptr<CoasterPager> pager);
+
+    System &system;
+    std::unique_ptr<CoasterPager> pager;
+    std::coroutine_handle<> handle;
+    std::atomic<bool> done{false};
+    std::vector<std::unique_ptr<Product>> products;
+    std::exception_ptr error;
+};
+
 class System {
 public:
     typedef std::unordered_map<std::string, std::shared_ptr<Machine>> machines_t;
-
+    typedef std::unordered_map<std::string, MachineAccess> access_t;
+    typedef std::function<void(std::vector<std::unique_ptr<Product>>,
+                               std::exception_ptr)> collect_callback_t;
+
+    // A worker may put off waiting for an order whose machines are backlogged
+    // and serve up to `dispatchFairness` later orders first; 0 serves every
+    // order in the order it was taken. With `maxWorkers` above
+    // numberOfWorkers the pool starts with numberOfWorkers workers and grows
+    // up to maxWorkers under load (see setScaling).
     System(machines_t machines, unsigned int numberOfWorkers,
-           unsigned int clientTimeout);
+           unsigned int clientTimeout, unsigned int dispatchFairness = 4,
+           unsigned int maxWorkers = 0);
+
+    // Machines missing from `access` are reached through virtualCalls().
+    System(machines_t machines, access_t access, unsigned int numberOfWorkers,
+           unsigned int clientTimeout, unsigned int dispatchFairness = 4,
+           unsigned int maxWorkers = 0);
 
     std::vector<WorkerReport> shutdown();
 
@@ -80,62 +227,443 @@ public:
 
     std::vector<unsigned int> getPendingOrders() const;
 
-    std::unique_ptr<CoasterPager> order(std::vector<std::string> products);
+    // `deadline` is relative to submission; zero means none.
+    std::unique_ptr<CoasterPager>
+    order(std::vector<std::string> products, Priority priority = Priority::NORMAL,
+          std::chrono::steady_clock::duration deadline = {});
+
+    std::unique_ptr<CoasterPager>
+    order(std::initializer_list<std::string> products,
+          Priority priority = Priority::NORMAL,
+          std::chrono::steady_clock::duration deadline = {});
+
+    std::unique_ptr<CoasterPager>
+    order(std::vector<ProductId> products, Priority priority = Priority::NORMAL,
+          std::chrono::steady_clock::duration deadline = {});
+
+    // Like order(), but returns nullptr instead of throwing
+    // SystemOverloadedException when admission control turns the order away.
+    std::unique_ptr<CoasterPager>
+    tryOrder(std::vector<std::string> products, Priority priority = Priority::NORMAL,
+             std::chrono::steady_clock::duration deadline = {});
+
+    std::unique_ptr<CoasterPager>
+    tryOrder(std::vector<ProductId> products, Priority priority = Priority::NORMAL,
+             std::chrono::steady_clock::duration deadline = {});
+
+    std::vector<std::unique_ptr<CoasterPager>>
+    orderBatch(std::vector<std::vector<std::string>> orders,
+               Priority priority = Priority::NORMAL,
+               std::chrono::steady_clock::duration deadline = {});
+
+    // Orders are turned away once `maxPending` orders wait to be taken by a
+    // worker (0: no limit) and, with `byEstimate`, when the estimated time
+    // to finish them exceeds their deadline (clientTimeout if they have
+    // none). The estimate is the orders queued ahead times the recent gap
+    // between finished orders, plus the longest machine backlog times that
+    // machine's recent fetch time per item.
+    void setAdmission(size_t maxPending, bool byEstimate);
+
+    // A machine that fails is taken off the menu and every request queued on
+    // it fails at once. With a non-zero interval it is probed for one
+    // product that often and put back on the menu once a probe succeeds.
+    void setProbeInterval(std::chrono::steady_clock::duration interval);
+
+    // Predictive prefetch, off while `limit` is 0. Each machine's fetcher
+    // tracks how many items were requested per `window` and, while it has no
+    // requests, fetches that many ahead (at most `limit`) into a stock that
+    // later requests are served from first. The stock goes back to the
+    // machine on shutdown.
+    void setPrefetch(size_t limit, std::chrono::steady_clock::duration window);
+
+    // Records order and machine events into a binary trace at `path` (see
+    // trace.hpp) until stopTrace() or shutdown(). The replay tool drives a
+    // System with such a trace.
+    void startTrace(const std::string &path);
+
+    void stopTrace();
+
+    // An elastic pool adds a worker while orders wait longer than `growAfter`
+    // on average before a worker takes them, and retires one once a worker
+    // has waited `idleAfter` for work. A retired worker's records stay in
+    // the report of its index, which the next worker started there extends.
+    void setScaling(std::chrono::steady_clock::duration growAfter,
+                    std::chrono::steady_clock::duration idleAfter);
+
+    ProductId getProductId(const std::string &product) const;
+
+    const std::string &getProductName(ProductId product) const;
 
     std::vector<std::unique_ptr<Product>>
     collectOrder(std::unique_ptr<CoasterPager> CoasterPager);
 
+    // Gives up on an order. Its requests still queued on machines are
+    // withdrawn, products already fetched go back to their machines and a
+    // worker waiting for it moves on. Orders that already failed or expired
+    // are left as they are.
+    void cancelOrder(std::unique_ptr<CoasterPager> CoasterPager);
+
+    std::vector<std::vector<std::unique_ptr<Product>>>
+    collectOrders(std::vector<std::unique_ptr<CoasterPager>> &CoasterPagers);
+
+    // Calls `callback` with the products, or the error collecting failed
+    // with, once the order is done: on the worker that finished it, or right
+    // away if it already is. Exceptions the callback throws are dropped.
+    void collectWhenReady(std::unique_ptr<CoasterPager> CoasterPager,
+                          collect_callback_t callback);
+
+    std::future<std::vector<std::unique_ptr<Product>>>
+    collectFuture(std::unique_ptr<CoasterPager> CoasterPager);
+
+    CollectAwaiter collectAsync(std::unique_ptr<CoasterPager> CoasterPager);
+
     unsigned int getClientTimeout() const;
 
+    SystemStats stats() const;
+
+    // Takes every report record written since the previous call. Records
+    // taken here are not part of the reports returned by shutdown().
+    CompactReport drainReports();
+
 private:
-    struct OrderData {
-        std::vector<std::unique_ptr<Product>> completed;
-        std::shared_ptr<OrderStatus> status;
+    typedef std::pair<ProductId, std::unique_ptr<Product>> collected_item_t;
+    typedef std::vector<collected_item_t, PoolAllocator<collected_item_t>> collected_t;
+
+    // Only the worker finishing the order waits on `cv`.
+    struct FetchCompletion {
         mutable std::mutex mut;
         mutable std::condition_variable cv;
-        mutable std::shared_ptr<std::condition_variable> pager_cv;
-        bool client_collecting{false};
-        mutable std::condition_variable collect_cv;
-        bool ready_to_collect{false};
+        size_t remaining{};
+        collected_t collected;
+        std::vector<ProductId> failed;
+        bool aborted{false};
+
+        // An order is done once one of its fetches failed; the rest skip it.
+        bool done() const { return remaining == 0 || aborted; }
     };
 
+    struct OrderData {
+        unsigned int id{};
+        std::atomic<OrderStatus> status{IN_PROGRES};
+        // Set once a pager sleeps on `status`.
+        std::atomic<bool> awaited{false};
+        std::vector<ProductId> products;
+        collected_t completed;
+        FetchCompletion fetch;
+        unsigned int worker{};
+        Priority priority{Priority::NORMAL};
+        collect_callback_t callback;
+        std::chrono::steady_clock::time_point deadline;
+        std::chrono::steady_clock::time_point submitted;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point ready;
+    };
+
+    struct FetchRequest {
+        Priority priority;
+        std::chrono::steady_clock::time_point deadline;
+        unsigned int id;
+        std::shared_ptr<FetchCompletion> completion;
+
+        bool operator>(const FetchRequest &other) const {
+            return std::tie(priority, deadline, id) >
+                   std::tie(other.priority, other.deadline, other.id);
+        }
+    };
+
+    // Grouped by who writes what, so that dispatching threads, the fetcher
+    // and threads returning products do not share cache lines.
     struct MachineData {
+        // Under `mut`, taken by dispatching threads and the fetcher.
         mutable std::mutex mut;
         mutable std::condition_variable cv;
-        std::queue<std::pair<unsigned int, unsigned int>> waiting;
+        std::vector<FetchRequest> waiting;
+        bool closing{false};
+        std::thread fetcher;
+        // Written by the fetcher, read by snapshots and admission.
+        alignas(64) std::atomic<uint64_t> fetched{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> fast_failed{0};
+        std::atomic<uint64_t> probes{0};
+        std::atomic<uint64_t> item_ns{0};
+        std::atomic<MachineHealth> health{MachineHealth::CLOSED};
+        std::chrono::steady_clock::time_point retry_at;
+        LatencyHistogram fetch_latency;
+        std::atomic<uint64_t> prefetched{0};
+        std::atomic<uint64_t> served_from_stock{0};
+        std::atomic<size_t> stocked{0};
+        // Used by the fetcher only.
+        std::vector<std::unique_ptr<Product>> stock;
+        uint64_t demand{0};
+        double expected_demand{0};
+        std::chrono::steady_clock::time_point window_start;
+        // Raised by dispatching threads, lowered by the fetcher.
+        alignas(64) std::atomic<size_t> backlog{0};
+        // Written by any thread returning products.
+        alignas(64) std::atomic<uint64_t> returned{0};
+    };
+
+    struct PriorityCounters {
+        std::atomic<uint64_t> orders{0};
+        std::atomic<uint64_t> with_deadline{0};
+        std::atomic<uint64_t> missed{0};
+        LatencyHistogram latency;
+    };
+
+    static constexpr unsigned int priorities = 3;
+
+    struct alignas(64) WorkerCounters {
+        std::atomic<uint64_t> ready{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> busy_ns{0};
+        std::atomic<uint64_t> idle_ns{0};
+        std::atomic<uint64_t> taken{0};
+        std::atomic<uint64_t> queued_ns{0};
+        LatencyHistogram queued;
+        LatencyHistogram preparing;
+        std::array<PriorityCounters, priorities> classes;
+    };
+
+    struct OrderCounters {
+        std::atomic<uint64_t> collected{0};
+        std::atomic<uint64_t> expired{0};
+        std::atomic<uint64_t> rejected{0};
+        std::atomic<uint64_t> cancelled{0};
+        LatencyHistogram collected_after;
+        LatencyHistogram expired_after;
+    };
+
+    struct alignas(64) WorkerSlot {
+        std::thread thread;
+        std::atomic<bool> retiring{false};
+        std::atomic<bool> exited{false};
+        // Steady clock ticks since the worker waits for work, 0 while busy.
+        std::atomic<std::chrono::steady_clock::duration::rep> idle_since{0};
+        // Used by the worker only.
+        uint64_t takes{0};
+    };
+
+    struct DeferredOrder {
+        std::shared_ptr<OrderData> order;
+        unsigned int passed{};
+    };
+
+    struct ReportEntry {
+        ReportKind kind{};
+        unsigned int order{};
+        std::vector<ProductId> products;
     };
 
-    bool is_open;
+    static constexpr size_t report_ring_capacity = 1024;
 
-    machines_t machines;
+    // Writers push lock-free; a writer that finds the ring full moves it into
+    // `retained` under `mut`, which drainReports also holds while draining.
+    struct ReportLog {
+        MPMCQueue<ReportEntry> ring{report_ring_capacity};
+        std::mutex mut;
+        CompactReport retained;
+    };
+
+    typedef std::unordered_map<unsigned int, std::shared_ptr<OrderData>,
+            std::hash<unsigned int>, std::equal_to<unsigned int>,
+            PoolAllocator<std::pair<const unsigned int, std::shared_ptr<OrderData>>>> order_map_t;
+
+    struct alignas(64) OrderShard {
+        mutable std::mutex mut;
+        order_map_t orders;
+    };
+
+    static constexpr unsigned int order_shards = 64;
+
+    static constexpr size_t pending_orders_capacity = 1 << 16;
+
+    static constexpr size_t fetch_batch_limit = 64;
+
+    static constexpr unsigned int aging_interval = 8;
+
+    // Orders of one priority class, spread over one ring per worker slot.
+    // A worker takes from its own ring first and steals from the others.
+    struct Lane {
+        std::vector<std::unique_ptr<MPMCQueue<std::shared_ptr<OrderData>>>> rings;
+
+        [[nodiscard]] size_t size() const {
+            size_t result = 0;
+            for (auto &ring: rings) {
+                result += ring->size();
+            }
+            return result;
+        }
+    };
+
+    std::atomic<bool> is_open;
+
+    std::vector<std::string> product_names;
+    std::unordered_map<std::string, ProductId> product_ids;
+    std::vector<std::shared_ptr<Machine>> machines;
+    std::vector<MachineAccess> access;
     unsigned int numberOfWorkers;
     unsigned int clientTimeout;
-    mutable std::mutex menu_mutex;
-    std::set<std::string> menu;
-    std::vector<std::thread> workers;
-    mutable std::mutex reports_mutex;
-    std::vector<WorkerReport> reports;
+    unsigned int dispatchFairness;
+    std::unique_ptr<std::atomic<bool>[]> menu;
+    unsigned int maxWorkers;
+    std::unique_ptr<WorkerSlot[]> workers;
+    std::atomic<unsigned int> active_workers{0};
+    // Slots that ever ran a worker; reports and stats cover these.
+    std::atomic<unsigned int> used_workers{0};
+    std::unique_ptr<ReportLog[]> report_logs;
+    std::unique_ptr<WorkerCounters[]> worker_stats;
+    mutable Striped<OrderCounters> order_stats;
 
     std::mutex machines_mutex;
-    std::map<std::string, std::shared_ptr<MachineData>> machines_data;
+    std::vector<std::unique_ptr<MachineData>> machines_data;
+
+    std::atomic<unsigned int> submitters{0};
+    // Hands each thread submitting to this System its first ring.
+    std::atomic<size_t> submit_clients{0};
+    std::array<Lane, priorities> lanes;
+    EventCount work_available;
+    std::atomic<bool> lanes_closed{false};
+
+    std::atomic<size_t> admission_max_pending{0};
+    std::atomic<bool> admission_estimate{false};
+    std::atomic<std::chrono::steady_clock::duration::rep> probe_interval{0};
+    std::atomic<size_t> prefetch_limit{0};
+    std::atomic<std::chrono::steady_clock::duration::rep> prefetch_window{0};
+    static constexpr uint64_t finish_window = 64;
+
+    std::atomic<uint64_t> finish_gap_ns{0};
+    alignas(64) std::atomic<uint64_t> finished_orders{0};
+    std::atomic<uint64_t> finish_window_start_ns{0};
+
+    std::atomic<unsigned int> current_order_id{0};
+    std::array<OrderShard, order_shards> orders_data;
+
+    struct Deadline {
+        std::chrono::steady_clock::time_point when;
+        unsigned int id;
+        bool reclaim;
+
+        bool operator>(const Deadline &other) const { return when > other.when; }
+    };
+
+    std::mutex deadlines_mutex;
+    std::condition_variable deadlines_cv;
+    bool deadlines_closing{false};
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<>> deadlines;
+    std::thread expirer;
+
+    static constexpr std::chrono::milliseconds scale_tick{10};
+
+    std::atomic<std::chrono::steady_clock::duration::rep> grow_after{
+            std::chrono::steady_clock::duration(std::chrono::milliseconds(1)).count()};
+    std::atomic<std::chrono::steady_clock::duration::rep> idle_after{
+            std::chrono::steady_clock::duration(std::chrono::seconds(1)).count()};
+    std::mutex scaler_mutex;
+    std::condition_variable scaler_cv;
+    bool scaler_closing{false};
+    std::thread scaler;
+
+    Tracer tracer;
+
+    OrderShard &shardOf(unsigned int id);
+
+    static void setStatus(OrderData &order, OrderStatus status);
+
+    std::vector<std::string>
+    productNames(const std::vector<ProductId> &products) const;
+
+    void report(unsigned int worker, ReportKind kind, unsigned int order,
+                std::vector<ProductId> products);
+
+    void drainLog(unsigned int worker, CompactReport &into);
+
+    void fetch(ProductId product, MachineData &data);
+
+    std::vector<std::unique_ptr<Product>> getFrom(ProductId product, size_t n);
+
+    void returnTo(ProductId product, std::vector<std::unique_ptr<Product>> products);
+
+    static bool deliver(FetchCompletion &completion, ProductId product,
+                        std::unique_ptr<Product> &item);
+
+    static bool skip(FetchCompletion &completion);
+
+    static void fail(FetchCompletion &completion, ProductId product);
+
+    void withdraw(ProductId product, FetchCompletion &completion);
+
+    void trip(ProductId product, MachineData &data);
+
+    void probe(ProductId product, MachineData &data);
+
+    void restock(ProductId product, MachineData &data);
+
+    void serveFromStock(ProductId product, MachineData &data,
+                        std::vector<std::shared_ptr<FetchCompletion>> &requests,
+                        size_t &served);
+
+    void collectProducts(ProductId product,
+                         std::vector<std::shared_ptr<FetchCompletion>> &requests);
+
+    void returnProducts(collected_t &products);
+
+    void schedule(unsigned int id, bool reclaim);
+
+    void expireOrder(unsigned int id);
+
+    void reclaimOrder(unsigned int id);
+
+    void expire();
+
+    void leaveSubmission();
+
+    bool onMenu(const std::vector<ProductId> &products) const;
+
+    std::shared_ptr<OrderData>
+    registerOrder(unsigned int id, std::vector<ProductId> products,
+                  Priority priority, std::chrono::steady_clock::duration deadline,
+                  CoasterPager &pager);
+
+    static void smooth(std::atomic<uint64_t> &average, uint64_t sample);
+
+    // Checks a batch of orders as a whole; the lanes are only scanned while
+    // admission control is on.
+    bool admit(std::span<const std::vector<ProductId>> orders, Priority priority,
+               std::chrono::steady_clock::duration deadline) const;
+
+    void submit(std::shared_ptr<OrderData> *orders, size_t count);
+
+    bool take(unsigned int worker, std::shared_ptr<OrderData> &order, bool wait);
+
+    void dispatch(const OrderData &order, std::shared_ptr<FetchCompletion> completion);
+
+    bool backlogged(const OrderData &order) const;
+
+    static bool fetched(const FetchCompletion &completion);
+
+    void finish(unsigned int worker, std::shared_ptr<OrderData> order);
+
+    void recordCollected(const OrderData &order);
+
+    static order_map_t::iterator
+    findOrder(OrderShard &shard, unsigned int id,
+              const std::atomic<OrderStatus> *status);
+
+    std::vector<std::unique_ptr<Product>>
+    collect(unsigned int id, const std::atomic<OrderStatus> *status);
+
+    void notifyCollector(unsigned int id, const std::atomic<OrderStatus> *status,
+                         collect_callback_t &callback);
+
+    void run(unsigned int worker);
 
-    mutable std::mutex pending_orders_mutex;
-    mutable std::condition_variable pending_orders_cv;
-    unsigned int current_order_id{};
-    std::list<long long> pending_orders;
-    std::set<unsigned int> orders_in_progress;
-    std::map<unsigned int, std::vector<std::string>> orders_products;
+    void startWorker(unsigned int worker);
 
-    mutable std::mutex orders_mutex;
-    std::map<unsigned int, std::shared_ptr<OrderData>> orders_data;
+    void retireWorker(unsigned int worker);
 
-    void collectProduct(unsigned int order_id, unsigned int my_id,
-                        std::string &product_name,
-                        WorkerReport &report,
-                        std::vector<std::pair<std::string, std::unique_ptr<Product>>> &collecting,
-                        std::mutex &mutex);
+    void reapWorker(unsigned int worker);
 
-    void run();
+    void scale();
 };
 
 #endif // SYSTEM_HPP
\ No newline at end of file
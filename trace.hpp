@@ -0,0 +1,343 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Order of the per-machine records, which belong to no order.
+inline constexpr uint32_t trace_no_order = UINT32_MAX;
+
+enum class TraceEvent : uint8_t {
+    SUBMITTED,      // value: relative deadline in ns, 0 for none
+    ITEM,           // one per product of the order submitted before
+    FETCH_QUEUED,
+    FETCH_STARTED,  // per machine, value: items asked for
+    FETCH_FINISHED, // per machine, value: items handed out, 0 if it failed
+    READY,
+    FAILED,
+    COLLECTED,
+    EXPIRED,
+    CANCELLED,
+    RETURNED        // per machine, value: items given back
+};
+
+struct TraceRecord {
+    uint64_t time_ns;
+    uint64_t value;
+    uint32_t order;
+    uint16_t product;
+    TraceEvent event;
+    uint8_t priority;
+};
+
+static_assert(sizeof(TraceRecord) == 24, "trace records are written as is");
+
+// A trace file is a TraceHeader, the product names (each a uint16_t length
+// and its bytes, in ProductId order) and then TraceRecords, ordered by time
+// within each recording thread only.
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t products;
+    uint32_t workers;
+    uint32_t client_timeout_ms;
+};
+
+inline constexpr char trace_magic[8] = {'C', 'P', 'T', 'R', 'A', 'C', 'E', '1'};
+
+// Single-producer ring written by one recording thread and drained by the
+// flusher; records that do not fit are dropped. When its thread exits the
+// ring is released and the next thread that starts recording claims it.
+class TraceRing {
+public:
+    static constexpr size_t capacity = 1 << 12;
+
+    bool tryClaim() { return !in_use.exchange(true, std::memory_order_acq_rel); }
+
+    void release() { in_use.store(false, std::memory_order_release); }
+
+    bool push(const TraceRecord &record) {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == capacity) return false;
+        records[h & (capacity - 1)] = record;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Calls f(records, count) for up to two contiguous runs.
+    template<typename F>
+    void drain(F f) {
+        auto t = tail.load(std::memory_order_relaxed);
+        auto h = head.load(std::memory_order_acquire);
+        while (t != h) {
+            auto first = t & (capacity - 1);
+            auto count = std::min(h - t, capacity - first);
+            f(&records[first], count);
+            t += count;
+        }
+        tail.store(t, std::memory_order_release);
+    }
+
+private:
+    std::array<TraceRecord, capacity> records;
+    std::atomic<bool> in_use{true};
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+// Records events into per-thread rings while a trace is open; a flusher
+// thread moves them into a memory-mapped file every flush_interval. When
+// no trace is open, record() is a single load.
+class Tracer {
+public:
+    static constexpr std::chrono::milliseconds flush_interval{10};
+
+    Tracer() : id(next_id.fetch_add(1) + 1) {}
+
+    Tracer(const Tracer &) = delete;
+
+    Tracer &operator=(const Tracer &) = delete;
+
+    ~Tracer() { close(); }
+
+    void open(const std::string &path, const std::vector<std::string> &products,
+              unsigned int workers, unsigned int client_timeout_ms) {
+        std::unique_lock<std::mutex> lock(mut);
+        if (fd >= 0) throw std::logic_error("a trace is already being recorded");
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+
+        // Whatever was recorded after the previous trace closed is stale.
+        discard();
+
+        TraceHeader header{};
+        std::memcpy(header.magic, trace_magic, sizeof(header.magic));
+        header.version = 2;
+        header.products = (uint32_t) products.size();
+        header.workers = workers;
+        header.client_timeout_ms = client_timeout_ms;
+        std::string prefix((const char *) &header, sizeof(header));
+        for (auto &product: products) {
+            auto length = (uint16_t) product.size();
+            prefix.append((const char *) &length, sizeof(length));
+            prefix.append(product, 0, length);
+        }
+        if (!append(prefix.data(), prefix.size())) {
+            closeFile();
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+
+        start = std::chrono::steady_clock::now();
+        closing = false;
+        enabled.store(true, std::memory_order_release);
+        flusher = std::thread([this] { flush(); });
+    }
+
+    // Writes out what was recorded so far and closes the file. Concurrent
+    // calls return once the first one has closed it.
+    void close() {
+        std::unique_lock<std::mutex> lock(mut);
+        if (fd < 0) return;
+        if (closing) {
+            cv.wait(lock, [this] { return fd < 0; });
+            return;
+        }
+        enabled.store(false);
+        closing = true;
+        cv.notify_all();
+        auto flushing = std::move(flusher);
+        lock.unlock();
+        flushing.join();
+
+        lock.lock();
+        drain();
+        closeFile();
+        cv.notify_all();
+    }
+
+    void record(TraceEvent event, uint32_t order, uint16_t product = 0,
+                uint64_t value = 0, uint8_t priority = 0) {
+        if (!enabled.load(std::memory_order_acquire)) return;
+        TraceRecord entry{(uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count(),
+                          value, order, product, event, priority};
+        if (!local().push(entry)) dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] uint64_t droppedRecords() const {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    static inline std::atomic<uint64_t> next_id{0};
+
+    const uint64_t id;
+    std::atomic<bool> enabled{false};
+    std::atomic<uint64_t> dropped{0};
+    std::chrono::steady_clock::time_point start;
+
+    std::mutex rings_mutex;
+    std::vector<std::shared_ptr<TraceRing>> rings;
+
+    std::mutex mut;
+    std::condition_variable cv;
+    bool closing{false};
+    std::thread flusher;
+
+    // Used by the flusher, or under `mut` once it stopped.
+    int fd{-1};
+    char *mapping{nullptr};
+    size_t mapped{0};
+    size_t size{0};
+
+    // A thread gets one ring per Tracer, found through a small thread-local
+    // list since a thread may record into several systems. The list releases
+    // its rings when the thread exits, so threads that come and go, like
+    // elastic workers, reuse rings instead of adding one each.
+    struct OwnedRings {
+        std::vector<std::pair<uint64_t, std::shared_ptr<TraceRing>>> rings;
+
+        ~OwnedRings() {
+            for (auto &entry: rings) {
+                entry.second->release();
+            }
+        }
+    };
+
+    TraceRing &local() {
+        thread_local OwnedRings owned;
+        for (auto &[owner, ring]: owned.rings) {
+            if (owner == id) return *ring;
+        }
+        // Rings of Tracers that are gone are only held here.
+        std::erase_if(owned.rings, [](const auto &entry) { return entry.second.use_count() == 1; });
+
+        std::unique_lock<std::mutex> lock(rings_mutex);
+        for (auto &ring: rings) {
+            if (ring->tryClaim()) {
+                owned.rings.emplace_back(id, ring);
+                return *ring;
+            }
+        }
+        rings.push_back(std::make_shared<TraceRing>());
+        owned.rings.emplace_back(id, rings.back());
+        return *rings.back();
+    }
+
+    void discard() {
+        std::unique_lock<std::mutex> lock(rings_mutex);
+        for (auto &ring: rings) {
+            ring->drain([](const TraceRecord *, size_t) {});
+        }
+    }
+
+    void drain() {
+        std::unique_lock<std::mutex> lock(rings_mutex);
+        for (auto &ring: rings) {
+            ring->drain([this](const TraceRecord *records, size_t count) {
+                if (!append(records, count * sizeof(TraceRecord)))
+                    dropped.fetch_add(count, std::memory_order_relaxed);
+            });
+        }
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock(mut);
+        while (!cv.wait_for(lock, flush_interval, [this] { return closing; })) {
+            lock.unlock();
+            drain();
+            lock.lock();
+        }
+    }
+
+    // The file grows by doubling and is cut to its real size on close.
+    bool append(const void *data, size_t bytes) {
+        if (size + bytes > mapped) {
+            auto grown = std::max<size_t>({mapped * 2, size + bytes, 1 << 20});
+            if (mapping != nullptr) munmap(mapping, mapped);
+            mapping = nullptr;
+            mapped = 0;
+            if (ftruncate(fd, (off_t) grown) != 0) return false;
+            auto address = mmap(nullptr, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) return false;
+            mapping = static_cast<char *>(address);
+            mapped = grown;
+        }
+        std::memcpy(mapping + size, data, bytes);
+        size += bytes;
+        return true;
+    }
+
+    void closeFile() {
+        if (mapping != nullptr) munmap(mapping, mapped);
+        if (ftruncate(fd, (off_t) size) != 0) dropped.fetch_add(1, std::memory_order_relaxed);
+        ::close(fd);
+        fd = -1;
+        mapping = nullptr;
+        mapped = 0;
+        size = 0;
+    }
+};
+
+struct Trace {
+    std::vector<std::string> products;
+    unsigned int workers{};
+    unsigned int client_timeout_ms{};
+    // Sorted by time.
+    std::vector<TraceRecord> records;
+};
+
+inline Trace readTrace(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("cannot open " + path);
+
+    TraceHeader header{};
+    in.read((char *) &header, sizeof(header));
+    if (!in || std::memcmp(header.magic, trace_magic, sizeof(header.magic)) != 0 ||
+        header.version != 2)
+        throw std::runtime_error(path + " is not a trace");
+
+    Trace trace;
+    trace.workers = header.workers;
+    trace.client_timeout_ms = header.client_timeout_ms;
+    for (uint32_t i = 0; i < header.products; i++) {
+        uint16_t length = 0;
+        in.read((char *) &length, sizeof(length));
+        std::string name(length, '\0');
+        in.read(name.data(), length);
+        trace.products.push_back(std::move(name));
+    }
+    if (!in) throw std::runtime_error(path + " is truncated");
+
+    TraceRecord record{};
+    while (in.read((char *) &record, sizeof(record))) {
+        trace.records.push_back(record);
+    }
+    std::stable_sort(trace.records.begin(), trace.records.end(),
+                     [](const TraceRecord &a, const TraceRecord &b) {
+                         return a.time_ns < b.time_ns;
+                     });
+
+    return trace;
+}
+
+#endif // TRACE_HPP